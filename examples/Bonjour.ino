@@ -37,8 +37,6 @@ void setup()
 
 void loop()
 {
-	while (true)
-	{
-		Bonjour.run();
-	}
+	// run() tells how long it has nothing to do; the time is free for other work
+	delay(Bonjour.run());
 }
\ No newline at end of file
@@ -26,55 +26,103 @@
 //  <http://www.gnu.org/licenses/>.
 //
 
-#define  HAS_SERVICE_REGISTRATION      1  // disabling saves about 1.25 kilobytes
-#define  HAS_NAME_BROWSING             1  // disable together with above, additionally saves about 4.3 kilobytes
-
 #include <string.h>
 #include <stdlib.h>
 
 #include "Bonjour.h"
 
 #define  MDNS_DEFAULT_NAME       "myspark"
-#define  MDNS_TLD                ".local"
-#define  DNS_SD_SERVICE          "_services._dns-sd._udp.local"
 #define  MDNS_SERVER_PORT        (5353)
-#define  MDNS_NQUERY_RESEND_TIME (1000)   // 1 second, name query resend timeout
-#define  MDNS_SQUERY_RESEND_TIME (10000)  // 10 seconds, service query resend timeout
+#define  MDNS_QUERY_INTERVAL_MIN (1000)   // 1 second, first interval between questions of a lookup,
+#define  MDNS_QUERY_INTERVAL_MAX (3600000UL)  // doubling up to an hour
+#define  MDNS_QUERY_WINDOW       (500)    // questions due within this go along with others due now
 #define  MDNS_RESPONSE_TTL       (120)    // two minutes (in seconds)
-
-#define  MDNS_MAX_SERVICES_PER_PACKET  (6)
+#define  MDNS_MULTICAST_INTERVAL (1000)   // 1 second, minimum interval between multicasts of a record
+#define  MDNS_PROBE_DEFENSE_INTERVAL (250) // same, when defending our names against a probe
+#define  MDNS_LEGACY_TTL         (10)     // 10 seconds, TTL cap in legacy unicast responses
+#define  MDNS_SHARED_DELAY_MIN   (20)     // random delay of responses with shared records (ms)
+#define  MDNS_SHARED_DELAY_MAX   (120)
+
+#define  MDNS_STARTUP_ANNOUNCEMENTS (3)   // announcements of a new record,
+#define  MDNS_STARTUP_INTERVAL   (1000)   // starting one second apart, the interval doubling
+#define  MDNS_REFRESH_INTERVAL   (1000UL * MDNS_RESPONSE_TTL * 3 / 4)   // then at 3/4 of the TTL,
+#define  MDNS_REFRESH_JITTER     (1000UL * MDNS_RESPONSE_TTL / 10)      // less up to a tenth of it
+#define  MDNS_REFRESH_WINDOW     (2000)   // refreshes due within this go with others due now
+#define  MDNS_PROBE_COUNT        (3)      // probes for our host name before it's used,
+#define  MDNS_PROBE_INTERVAL     (250)    // 250 ms apart
+#define  MDNS_POLL_INTERVAL      (100)    // longest run() asks to be left alone, since queries can't be foreseen
+#define  MDNS_MAX_PACKETS_PER_RUN (4)     // incoming packets handled in one run()
+#define  MDNS_CACHE_MAX_TTL      (86400)  // one day (in seconds), longer TTLs are cut down to this
+#define  MDNS_CACHE_GRACE_TIME   (1000)   // 1 second, cached records flushed or said goodbye to are kept for
+#define  MDNS_CACHE_REFRESHES    (4)      // cached records still wanted are asked for again at 80% of their TTL,
+#define  MDNS_CACHE_REFRESH_STEP (5)      // then at 85, 90 and 95% (in percent),
+#define  MDNS_CACHE_REFRESH_JITTER (2)    // each plus up to 2% more
 
 //#define  _BROKEN_MALLOC_   1
-#undef _USE_MALLOC_
 
 static IPAddress mdnsMulticastIPAddr(224, 0, 0, 251);
 
-typedef enum _MDNSPacketType_t {
-   MDNSPacketTypeMyIPAnswer,
-   MDNSPacketTypeNoIPv6AddrAvailable,
-   MDNSPacketTypeServiceRecord,
-   MDNSPacketTypeServiceRecordRelease,
-   MDNSPacketTypeNameQuery,
-   MDNSPacketTypeServiceQuery,
-} MDNSPacketType_t;
-
-typedef struct _DNSHeader_t {
-   uint16_t    xid;
-   uint8_t     recursionDesired:1;
-   uint8_t     truncated:1;
-   uint8_t     authoritiveAnswer:1;
-   uint8_t     opCode:4;
-   uint8_t     queryResponse:1;
-   uint8_t     responseCode:4;
-   uint8_t     checkingDisabled:1;
-   uint8_t     authenticatedData:1;
-   uint8_t     zReserved:1;
-   uint8_t     recursionAvailable:1;
-   uint16_t    queryCount;
-   uint16_t    answerCount;
-   uint16_t    authorityCount;
-   uint16_t    additionalCount;
-} __attribute__((__packed__)) DNSHeader_t;
+// deadlines are compared by their difference, so they keep their order when millis()
+// wraps around, as long as they are less than 24 days apart
+static inline int deadline_before(unsigned long a, unsigned long b)
+{
+    return (long)(a - b) < 0;
+}
+
+// records owed in a response, see MDNSAnswerSet_t.
+// the low nibble is what goes into the answer section, the high nibble
+// what goes into the additional section (unless it's answered already)
+#define  MDNS_ANSWER_A                 (0x01)   // host
+#define  MDNS_ANSWER_NSEC              (0x02)   // host, there's no other address than A
+#define  MDNS_ANSWER_PTR               (0x01)   // service records
+#define  MDNS_ANSWER_SRV               (0x02)
+#define  MDNS_ANSWER_TXT               (0x04)
+#define  MDNS_ANSWER_SERVICES          (0x08)   // _services._dns-sd._udp PTR to the service type
+#define  MDNS_ADDITIONAL(flags)        ((flags) << 4)
+
+// service records only get flags through answers_add(), and only lose them through
+// answers_clear() and answers_compact(), which keeps their list in step
+static void answers_add(MDNSAnswerSet_t* answers, int recordIndex, uint8_t flags)
+{
+    if (recordIndex < 0) {
+        answers->host |= flags;
+        return;
+    }
+
+    if (0 == answers->records[recordIndex])
+        answers->listed[answers->count++] = recordIndex;
+    answers->records[recordIndex] |= flags;
+}
+
+static void answers_clear(MDNSAnswerSet_t* answers)
+{
+    for (uint16_t k = 0; k < answers->count; k++)
+        answers->records[answers->listed[k]] = 0;
+
+    answers->host = 0;
+    answers->count = 0;
+}
+
+// takes the records whose flags were cleared in place off the list
+static void answers_compact(MDNSAnswerSet_t* answers)
+{
+    uint16_t kept = 0;
+
+    for (uint16_t k = 0; k < answers->count; k++)
+        if (0 != answers->records[answers->listed[k]])
+            answers->listed[kept++] = answers->listed[k];
+
+    answers->count = kept;
+}
+
+// the record index at a position of the list, where -1 stands for our host
+static inline int answers_record(const MDNSAnswerSet_t* answers, int k)
+{
+    return (k < 0) ? -1 : answers->listed[k];
+}
+
+// id, flags, then the question, answer, authority and additional counts
+#define  DNS_HEADER_SIZE               (12)
 
 typedef enum _DNSOpCode_t {
    DNSOpQuery     = 0,
@@ -84,6 +132,78 @@ typedef enum _DNSOpCode_t {
    DNSOpUpdate    = 5
 } DNSOpCode_t;
 
+typedef enum _DNSRecordType_t {
+   DNSTypeA       = 0x01,
+   DNSTypePTR     = 0x0c,
+   DNSTypeTXT     = 0x10,
+   DNSTypeAAAA    = 0x1c,
+   DNSTypeSRV     = 0x21,
+   DNSTypeNSEC    = 0x2f,
+   DNSTypeANY     = 0xff
+} DNSRecordType_t;
+
+#define  DNSClassIN                    (0x0001)
+#define  DNS_CLASS_CACHE_FLUSH         (0x8000)   // in answers
+#define  DNS_CLASS_UNICAST_RESPONSE    (0x8000)   // in questions
+
+#define  DNS_FLAG_QR                   (0x8000)
+#define  DNS_FLAG_AA                   (0x0400)
+#define  DNS_FLAG_TC                   (0x0200)
+#define  DNS_FLAGS_OPCODE(flags)       (((flags) >> 11) & 0x0f)
+
+// read cursor over a received packet.
+// every read is bounds-checked; once the cursor runs past the end of the data,
+// the error flag is raised and all further reads return zeroes/NULL.
+typedef struct _MDNSReader_t {
+   const uint8_t* data;
+   uint16_t       len;
+   uint16_t       pos;
+   uint8_t        error;
+} MDNSReader_t;
+
+static inline void reader_init(MDNSReader_t* r, const uint8_t* data, int len)
+{
+   r->data = data;
+   r->len = (len > 0) ? (uint16_t)len : 0;
+   r->pos = 0;
+   r->error = 0;
+}
+
+static inline const uint8_t* reader_read_bytes(MDNSReader_t* r, uint16_t n)
+{
+   if (r->error || n > r->len - r->pos) {
+      r->error = 1;
+      return NULL;
+   }
+
+   const uint8_t* p = r->data + r->pos;
+   r->pos += n;
+   return p;
+}
+
+static inline void reader_skip(MDNSReader_t* r, uint16_t n)
+{
+   (void)reader_read_bytes(r, n);
+}
+
+static inline uint8_t reader_read_u8(MDNSReader_t* r)
+{
+   const uint8_t* p = reader_read_bytes(r, 1);
+   return p ? p[0] : 0;
+}
+
+static inline uint16_t reader_read_u16(MDNSReader_t* r)
+{
+   const uint8_t* p = reader_read_bytes(r, 2);
+   return p ? (((uint16_t)p[0] << 8) | p[1]) : 0;
+}
+
+static inline uint32_t reader_read_u32(MDNSReader_t* r)
+{
+   const uint8_t* p = reader_read_bytes(r, 4);
+   return p ? (((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3]) : 0;
+}
+
 // for some reason, I get data corruption issues with normal malloc() on arduino 0017
 void* my_malloc(unsigned s)
 {
@@ -111,24 +231,344 @@ void my_free(void* ptr)
 #endif
 }
 
+#define  MDNS_MAX_NAME_LEN             (255)
+#define  MDNS_MAX_LABEL_LEN            (63)
+#define  MDNS_MAX_NAME_JUMPS           (16)
+
+#define  DNS_IS_NAME_POINTER(len)      (0xc0 == ((len) & 0xc0))
+
+// wire format names we always own (string literals provide the terminating zero)
+static const uint8_t mdnsServicesName[]  = "\x09_services\x07_dns-sd\x04_udp\x05local";
+static const uint8_t mdnsRootName[]      = "";
+static const uint8_t mdnsTldPostfix[]    = "\x05local";
+static const uint8_t mdnsTcpPostfix[]    = "\x04_tcp\x05local";
+static const uint8_t mdnsUdpPostfix[]    = "\x04_udp\x05local";
+
+static const uint8_t* wire_postfix_for_protocol(MDNSServiceProtocol_t proto)
+{
+   return (MDNSServiceUDP == proto) ? mdnsUdpPostfix : mdnsTcpPostfix;
+}
+
+// encodes a dotted name followed by an already encoded postfix into DNS wire format.
+// return value: length of the encoded name, or 0 if it's invalid or doesn't fit
+static uint16_t encode_wire_name(const char* name, const uint8_t* postfix, uint16_t postfixLen,
+                                 uint8_t* out, uint16_t outSize)
+{
+   uint16_t len = 0;
+
+   while (*name) {
+      const char* end = name;
+      while (*end && '.' != *end) end++;
+
+      uint16_t labelLen = end - name;
+      if (0 == labelLen || labelLen > MDNS_MAX_LABEL_LEN || len + 1 + labelLen > outSize)
+         return 0;
+
+      out[len++] = (uint8_t)labelLen;
+      memcpy(out + len, name, labelLen);
+      len += labelLen;
+
+      name = *end ? end + 1 : end;
+   }
+
+   if (len + postfixLen > outSize || len + postfixLen > MDNS_MAX_NAME_LEN)
+      return 0;
+
+   if (postfixLen > 0)
+      memcpy(out + len, postfix, postfixLen);
+   return len + postfixLen;
+}
+
+static uint8_t* alloc_wire_name(const char* name, const uint8_t* postfix, uint16_t postfixLen, uint16_t* pLen)
+{
+   // every dot turns into a length byte, plus one for the first label
+   uint16_t size = strlen(name) + 1 + postfixLen;
+
+   uint8_t* wire = (uint8_t*)my_malloc(size);
+   if (NULL == wire)
+      return NULL;
+
+   *pLen = encode_wire_name(name, postfix, postfixLen, wire, size);
+   if (0 == *pLen) {
+      my_free(wire);
+      return NULL;
+   }
+
+   return wire;
+}
+
+static inline uint8_t lower_char(uint8_t c)
+{
+   return (c >= 'A' && c <= 'Z') ? (c | 0x20) : c;
+}
+
+static int labels_equal(const uint8_t* a, const uint8_t* b, uint8_t len)
+{
+   while (len-- > 0)
+      if (lower_char(*a++) != lower_char(*b++))
+         return 0;
+   return 1;
+}
+
+#if defined(HAS_NAME_BROWSING) && HAS_NAME_BROWSING
+
+// compares two wire format names, ignoring case
+static int wire_names_equal(const uint8_t* a, const uint8_t* b)
+{
+   for (;;) {
+      if (*a != *b)
+         return 0;
+      if (0 == *a)
+         return 1;
+      if (!labels_equal(a + 1, b + 1, *a))
+         return 0;
+
+      a += 1 + *a;
+      b += 1 + *b;
+   }
+}
+
+// the length of a wire format name, including its root label
+static uint16_t wire_name_length(const uint8_t* name)
+{
+   uint16_t len = 0;
+
+   while (0 != name[len])
+      len += 1 + name[len];
+
+   return len + 1;
+}
+
+#endif // defined(HAS_NAME_BROWSING) && HAS_NAME_BROWSING
+
+// compares the name at the given packet offset with a wire format name (ignoring case),
+// following compression pointers.
+// return values:
+// 1 if the names are equal
+// 0 otherwise
+static int packet_name_equals(const MDNSReader_t* r, uint16_t pos, const uint8_t* name)
+{
+   uint8_t jumps = 0;
+
+   for (;;) {
+      if (pos >= r->len)
+         return 0;
+
+      uint8_t len = r->data[pos];
+
+      if (DNS_IS_NAME_POINTER(len)) {
+         if (pos + 1 >= r->len || ++jumps > MDNS_MAX_NAME_JUMPS)
+            return 0;
+
+         pos = ((uint16_t)(len & 0x3f) << 8) | r->data[pos + 1];
+         continue;
+      }
+
+      if (len > MDNS_MAX_LABEL_LEN || len != *name)
+         return 0;
+
+      if (0 == len)
+         return 1;
+
+      if (pos + 1 + len > r->len || !labels_equal(r->data + pos + 1, name + 1, len))
+         return 0;
+
+      pos += 1 + len;
+      name += 1 + len;
+   }
+}
+
+#if defined(HAS_NAME_BROWSING) && HAS_NAME_BROWSING
+
+// decodes the name at the given packet offset into wire format, following compression pointers.
+// return value: length of the decoded name, or 0 if it's invalid or doesn't fit
+static uint16_t packet_name_decode(const MDNSReader_t* r, uint16_t pos, uint8_t* out, uint16_t outSize)
+{
+   uint16_t len = 0;
+   uint8_t jumps = 0;
+
+   for (;;) {
+      if (pos >= r->len)
+         return 0;
+
+      uint8_t labelLen = r->data[pos];
+
+      if (DNS_IS_NAME_POINTER(labelLen)) {
+         if (pos + 1 >= r->len || ++jumps > MDNS_MAX_NAME_JUMPS)
+            return 0;
+
+         pos = ((uint16_t)(labelLen & 0x3f) << 8) | r->data[pos + 1];
+         continue;
+      }
+
+      if (labelLen > MDNS_MAX_LABEL_LEN || len + 1 + labelLen > outSize || pos + 1 + labelLen > r->len)
+         return 0;
+
+      out[len++] = labelLen;
+      if (0 == labelLen)
+         return len;
+
+      memcpy(out + len, r->data + pos + 1, labelLen);
+      len += labelLen;
+      pos += 1 + labelLen;
+   }
+}
+
+#endif // defined(HAS_NAME_BROWSING) && HAS_NAME_BROWSING
+
+// FNV-1a over the lowercased labels, including their length bytes
+#define  MDNS_NAME_HASH_SEED           (2166136261UL)
+#define  MDNS_NAME_HASH_PRIME          (16777619UL)
+
+static inline uint32_t name_hash_update(uint32_t hash, uint8_t c)
+{
+   return (hash ^ lower_char(c)) * MDNS_NAME_HASH_PRIME;
+}
+
+static uint32_t wire_name_hash(const uint8_t* name)
+{
+   uint32_t hash = MDNS_NAME_HASH_SEED;
+
+   for (;;) {
+      uint8_t len = *name;
+      hash = name_hash_update(hash, len);
+      if (0 == len)
+         return hash;
+
+      for (uint8_t i = 1; i <= len; i++)
+         hash = name_hash_update(hash, name[i]);
+      name += 1 + len;
+   }
+}
+
+// reads a (possibly compressed) name at the reader position, and returns the hash of
+// the whole label sequence, computed the same way as wire_name_hash() does.
+static uint32_t reader_read_name_hash(MDNSReader_t* r)
+{
+   uint32_t hash = MDNS_NAME_HASH_SEED;
+   MDNSReader_t cur = *r;
+   uint8_t jumps = 0;
+
+   for (;;) {
+      uint8_t len = reader_read_u8(&cur);
+
+      if (DNS_IS_NAME_POINTER(len)) {
+         uint16_t pos = ((uint16_t)(len & 0x3f) << 8) | reader_read_u8(&cur);
+
+         // the name in the packet ends right after the first pointer
+         if (0 == jumps)
+            *r = cur;
+
+         if (cur.error || pos >= cur.len || ++jumps > MDNS_MAX_NAME_JUMPS) {
+            r->error = 1;
+            break;
+         }
+
+         cur.pos = pos;
+         continue;
+      }
+
+      const uint8_t* label = (len <= MDNS_MAX_LABEL_LEN) ? reader_read_bytes(&cur, len) : NULL;
+      if (NULL == label) {
+         r->error = 1;
+         break;
+      }
+
+      hash = name_hash_update(hash, len);
+      for (uint8_t i = 0; i < len; i++)
+         hash = name_hash_update(hash, label[i]);
+
+      if (0 == len) {
+         if (0 == jumps)
+            *r = cur;
+         break;
+      }
+   }
+
+   return hash;
+}
+
+#if defined(HAS_NAME_BROWSING) && HAS_NAME_BROWSING
+
+// a record in a received packet, by the positions of its name and data
+typedef struct _MDNSRecordView_t {
+   uint16_t       namePos;
+   uint32_t       nameHash;
+   uint16_t       type;
+   uint16_t       rclass;
+   uint32_t       ttl;
+   uint16_t       dataPos;
+   uint16_t       dataLen;
+} MDNSRecordView_t;
+
+// reads the record at the reader position.
+// return values:
+// 1 on success
+// 0 if the packet ends before the record does
+static int reader_read_record(MDNSReader_t* r, MDNSRecordView_t* rec)
+{
+   rec->namePos = r->pos;
+   rec->nameHash = reader_read_name_hash(r);
+   rec->type = reader_read_u16(r);
+   rec->rclass = reader_read_u16(r);
+   rec->ttl = reader_read_u32(r);
+   rec->dataLen = reader_read_u16(r);
+   rec->dataPos = r->pos;
+
+   return NULL != reader_read_bytes(r, rec->dataLen);
+}
+
+#endif // defined(HAS_NAME_BROWSING) && HAS_NAME_BROWSING
+
 BonjourClass::BonjourClass()
 {
    memset(&_mdnsData, 0, sizeof(MDNSDataInternal_t));
    memset(&_serviceRecords, 0, sizeof(_serviceRecords));
+   memset(&_nameIndex, 0, sizeof(_nameIndex));
    
    _state = MDNSStateIdle;
    _writeOffset = 0;
+   _writeOverflow = 0;
+   _packetNameCount = 0;
+   _packetPort = 0;
+   _packetXid = 0;
+   _packetFlags = 0;
+   memset(_packetCounts, 0, sizeof(_packetCounts));
    
    _bonjourName = NULL;
-   _resolveNames[0] = NULL;
-   _resolveNames[1] = NULL;
+   _bonjourNameLength = 0;
+#if defined(HAS_NAME_BROWSING) && HAS_NAME_BROWSING
+   memset(_queries, 0, sizeof(_queries));
+   memset(_cache, 0, sizeof(_cache));
+   memset(_instances, 0, sizeof(_instances));
+   _snooping = 0;
+   memset(_snoopTypes, 0, sizeof(_snoopTypes));
+   _nameFoundCallback = NULL;
+   _serviceFoundCallback = NULL;
+#endif
    
-   _lastAnnounceMillis = 0;
+   memset(&_scheduledAnswers, 0, sizeof(_scheduledAnswers));
+   memset(&_queryAnswers, 0, sizeof(_queryAnswers));
+   memset(&_queryUnicastAnswers, 0, sizeof(_queryUnicastAnswers));
+   memset(&_queryKnownAnswers, 0, sizeof(_queryKnownAnswers));
+   memset(&_cachedResponseAnswers, 0, sizeof(_cachedResponseAnswers));
+   _cachedResponse = NULL;
+   _cachedResponseLength = 0;
+   
+   _timerCount = 0;
+   for (int i = 0; i < MDNS_TIMER_COUNT; i++)
+      _timerSlots[i] = MDNS_TIMER_NONE;
+   
+   _suppressedAnswers = 0;
+   _hostLastMulticast[0] = _hostLastMulticast[1] = millis() - MDNS_MULTICAST_INTERVAL;
+   memset(_announcedIP, 0, sizeof(_announcedIP));
+   memset(_linkIP, 0, sizeof(_linkIP));
+   _probeCount = 0;
 }
 
 BonjourClass::~BonjourClass()
 {
-    stop();
+    end();
 }
 
 int BonjourClass::beginPacket(IPAddress ip, uint16_t port)
@@ -138,969 +578,2542 @@ int BonjourClass::beginPacket(IPAddress ip, uint16_t port)
         (void)endPacket();
     
     _writeOffset = 0;
+    _writeOverflow = 0;
+    _packetNameCount = 0;
     return UDP::beginPacket(ip, port);
 }
 
 size_t BonjourClass::write(const uint8_t *buffer, size_t len)
 {
-    size_t empty = sizeof(_writeBuffer) - _writeOffset;
-    if (len > empty) len = empty;
-    memcpy(_writeBuffer + _writeOffset, buffer, len);
-    _writeOffset += len;
-    return len;
+    if (len > sizeof(_writeBuffer)) {
+        _writeOverflow = 1;
+        return 0;
+    }
+    
+    _writeBytes(buffer, len);
+    return _writeOverflow ? 0 : len;
 }
 
 int BonjourClass::endPacket()
 {
     int r = UDP::write(_writeBuffer, _writeOffset);
     _writeOffset = 0;
+    _writeOverflow = 0;
+    _packetNameCount = 0;
     return r;
 }
 
-// return values:
-// 1 on success
-// 0 otherwise
-int BonjourClass::begin(const char* bonjourName)
+// drops everything written from the given offset on, e.g. a record that didn't fit
+void BonjourClass::_truncatePacket(size_t offset)
 {
-	// wait for network to be ready
-	while (millis() < 5000 && !WiFi.ready()) SPARK_WLAN_Loop();
+    _writeOffset = offset;
+    _writeOverflow = 0;
 
-	int statusCode = 0;
-	statusCode = setBonjourName(bonjourName);
-	if (statusCode)
-	    statusCode = UDP::begin(MDNS_SERVER_PORT);
+    // names written there can't be pointed to anymore
+    while (_packetNameCount > 0 && _packetNames[_packetNameCount - 1].offset >= offset)
+        _packetNameCount--;
+}
 
-	return statusCode;
+// starts a packet of ours; where it goes and its header are kept for the packets
+// continuing it, see _fitEntry()
+void BonjourClass::_startPacket(IPAddress ip, uint16_t port, uint16_t xid, uint16_t flags)
+{
+    beginPacket(ip, port);
+    _writeHeader(xid, flags);
+
+    _packetAddress = ip;
+    _packetPort = port;
+    _packetXid = xid;
+    _packetFlags = flags;
+    memset(_packetCounts, 0, sizeof(_packetCounts));
 }
 
-// return values:
-// 1 on success
-// 0 otherwise
-int BonjourClass::begin()
+// fills in the counts, adds the given header flags, and sends the packet
+void BonjourClass::_finishPacket(uint16_t flags)
 {
-    return begin(MDNS_DEFAULT_NAME);
+    _writeCounts(_packetCounts[0], _packetCounts[1], _packetCounts[2], _packetCounts[3]);
+    _addHeaderFlags(flags);
+    endPacket();
 }
 
-// return values:
-// 1 on success
-// 0 otherwise
-int BonjourClass::_initQuery(uint8_t idx, const char* name, unsigned long timeout)
+// to be called after a question or record was written from the given mark on into a section
+// of the packet (0 questions ... 3 additionals): it's counted if it fit. if it didn't, it's
+// taken out again, and if the packet may be split and holds anything else, that's sent with
+// the given header flags and a packet continuing it started, for the entry to be written
+// into once more.
+// return value:
+// MDNSSuccess if it fit, MDNSTryLater if it's to be written again, MDNSOutOfMemory if
+// there's no room for it
+MDNSError_t BonjourClass::_fitEntry(size_t mark, uint8_t section, uint8_t split, uint16_t flags)
 {
-    int statusCode = 0;
-    
-    if (NULL == _resolveNames[idx] && NULL != ((0 == idx) ? (void*)_nameFoundCallback : (void*)_serviceFoundCallback)) 
-    {
-        _resolveNames[idx] = (uint8_t*)name;
-      
-        if (timeout)
-            _resolveTimeouts[idx] = millis() + timeout;
-        else
-            _resolveTimeouts[idx] = 0;
-      
-        statusCode = (MDNSSuccess == _sendMDNSMessage(NULL, 0, (idx == 0) ? MDNSPacketTypeNameQuery : MDNSPacketTypeServiceQuery, 0));
-    } 
-    else
-        my_free((void*)name);
-    
-    return statusCode;
+    if (!_writeOverflow) {
+        _packetCounts[section]++;
+        return MDNSSuccess;
+    }
+
+    _truncatePacket(mark);
+
+    // it's alone in the packet, or there's no packet to follow: there's no room for it
+    if (!split || 0 == _packetCounts[0] + _packetCounts[1] + _packetCounts[2] + _packetCounts[3])
+        return MDNSOutOfMemory;
+
+    _finishPacket(flags);
+    _startPacket(_packetAddress, _packetPort, _packetXid, _packetFlags);
+    return MDNSTryLater;
 }
 
-void BonjourClass::_cancelQuery(uint8_t idx)
+// with compressed names, the data length of a record is only known once its data is written;
+// the length field is filled in afterwards
+void BonjourClass::_fixDataLength(size_t lengthOffset)
 {
-    if (NULL == _resolveNames[idx]) return;
-    my_free(_resolveNames[idx]);
-    _resolveNames[idx] = NULL;
+    if (_writeOverflow || lengthOffset + 2 > _writeOffset)
+        return;
+
+    uint16_t len = _writeOffset - lengthOffset - 2;
+    _writeBuffer[lengthOffset] = len >> 8;
+    _writeBuffer[lengthOffset + 1] = len & 0xff;
 }
 
+// the network doesn't have to be up yet: begin() returns right away, and the responder
+// starts from run() once it is.
 // return values:
 // 1 on success
 // 0 otherwise
-int BonjourClass::resolveName(const char* name, unsigned long timeout)
-{   
-	cancelResolveName();
-   
-	char* n = (char*)my_malloc(strlen(name) + 7);
-	if (NULL == n)
-		return 0;
-   
-	strcpy(n, name);
-   	strcat(n, MDNS_TLD);
-   	return _initQuery(0, n, timeout);
+int BonjourClass::begin(const char* bonjourName)
+{
+	if (!setBonjourName(bonjourName))
+	    return 0;
+
+	if (MDNSStateIdle == _state)
+	    _state = MDNSStateWaitingForLink;
+
+	return 1;
 }
 
-void BonjourClass::setNameResolvedCallback(BonjourNameFoundCallback newCallback)
+// moves the responder along: it waits for the network, opens the socket, probes for our
+// host name (RFC 6762 8.1), then answers queries and announces our services. whenever the
+// link drops or our address changes, it starts over.
+void BonjourClass::_updateState()
 {
-   	_nameFoundCallback = newCallback;
+    if (MDNSStateIdle == _state)
+        return;
+
+    IPAddress myIp = WiFi.localIP();
+    uint8_t linkUp = WiFi.ready() && 0 != (myIp[0] | myIp[1] | myIp[2] | myIp[3]);
+
+    if (MDNSStateWaitingForLink != _state &&
+        (!linkUp || myIp[0] != _linkIP[0] || myIp[1] != _linkIP[1] || myIp[2] != _linkIP[2] || myIp[3] != _linkIP[3])) {
+        stop();
+        _state = MDNSStateWaitingForLink;
+    }
+
+    switch (_state)
+    {
+        case MDNSStateWaitingForLink:
+            if (!linkUp)
+                break;
+
+            for (uint8_t i = 0; i < 4; i++)
+                _linkIP[i] = myIp[i];
+            _state = MDNSStateBinding;
+            // fall through
+
+        case MDNSStateBinding:
+            // if the socket can't be opened yet, it's tried again on the next run
+            if (!UDP::begin(MDNS_SERVER_PORT))
+                break;
+
+            _startProbing();
+
+#if defined(HAS_NAME_BROWSING) && HAS_NAME_BROWSING
+            // lookups started without a socket go out now
+            for (int i = 0; i < MDNS_MAX_QUERIES; i++)
+                if (MDNSQueryNone != _queries[i].kind)
+                    _setTimer(MDNSTimerQuery + i, millis());
+#endif
+            break;
+
+        default:
+            break;
+    }
 }
 
-void BonjourClass::cancelResolveName()
+// the first probe goes out after a random delay of up to 250 ms, so that devices
+// powered up together don't probe in step
+void BonjourClass::_startProbing()
 {
-   	_cancelQuery(0);
+    _state = MDNSStateProbing;
+    _probeCount = 0;
+    _setTimer(MDNSTimerProbe, millis() + random(MDNS_PROBE_INTERVAL));
 }
 
-int BonjourClass::isResolvingName()
+void BonjourClass::_probe()
+{
+    if (MDNSStateProbing != _state)
+        return;
+
+    if (_probeCount < MDNS_PROBE_COUNT) {
+        _sendProbe();
+        _probeCount++;
+        _setTimer(MDNSTimerProbe, millis() + MDNS_PROBE_INTERVAL);
+        return;
+    }
+
+    // nobody objected, the name is ours
+    _state = MDNSStateAnnouncing;
+    _restartAnnouncements();
+}
+
+// a probe asks for our host name, and lists the record we're about to use for it in the
+// authority section. only the first one asks for unicast responses.
+void BonjourClass::_sendProbe()
 {
-	return (NULL != _resolveNames[0]);
+    beginPacket(mdnsMulticastIPAddr, MDNS_SERVER_PORT);
+
+    _writeHeader(0, 0);
+    _writeQuestion(_bonjourName, DNSTypeANY, DNSClassIN | ((0 == _probeCount) ? DNS_CLASS_UNICAST_RESPONSE : 0));
+    _writeA(_bonjourName, MDNS_RESPONSE_TTL, 0);
+    _writeCounts(1, 0, 1, 0);
+
+    if (!_writeOverflow)
+        endPacket();
+    else
+        _truncatePacket(0);
 }
 
-void BonjourClass::setServiceFoundCallback(BonjourServiceFoundCallback newCallback)
+// somebody else answered for our host name while we were probing for it. a new name is made
+// by appending a number, or counting it up ("myspark" becomes "myspark-2", then "myspark-3"),
+// and probed for instead (RFC 6762 9).
+void BonjourClass::_renameAfterConflict()
 {
-	_serviceFoundCallback = newCallback;
+    uint8_t label[MDNS_MAX_LABEL_LEN];
+    uint8_t len = _bonjourName[0];
+    uint8_t end = len;
+    uint16_t number = 2;
+
+    memcpy(label, _bonjourName + 1, len);
+
+    // an earlier number is dropped
+    while (end > 0 && label[end - 1] >= '0' && label[end - 1] <= '9')
+        end--;
+
+    if (end > 1 && end < len && len - end <= 4 && '-' == label[end - 1]) {
+        number = 0;
+        for (uint8_t i = end; i < len; i++)
+            number = number * 10 + (label[i] - '0');
+        number++;
+        len = end - 1;
+    }
+
+    uint8_t digits[5];
+    uint8_t digitCount = 0;
+    for (uint16_t n = number; n > 0; n /= 10)
+        digits[digitCount++] = '0' + n % 10;
+
+    if (len + 1 + digitCount > MDNS_MAX_LABEL_LEN)
+        len = MDNS_MAX_LABEL_LEN - 1 - digitCount;
+
+    label[len++] = '-';
+    while (digitCount > 0)
+        label[len++] = digits[--digitCount];
+
+    // the labels after the first one stay as they are
+    uint16_t restLength = _bonjourNameLength - 1 - _bonjourName[0];
+    uint8_t* name = (uint8_t*)my_malloc(1 + len + restLength);
+    if (NULL == name) {
+        _startProbing();
+        return;
+    }
+
+    name[0] = len;
+    memcpy(name + 1, label, len);
+    memcpy(name + 1 + len, _bonjourName + 1 + _bonjourName[0], restLength);
+    _useBonjourName(name, 1 + len + restLength);
 }
 
 // return values:
 // 1 on success
 // 0 otherwise
-int BonjourClass::startDiscoveringService(const char* serviceName, MDNSServiceProtocol_t proto, unsigned long timeout)
-{   
-	stopDiscoveringService();
-   
-	char* n = (char*)my_malloc(strlen(serviceName) + 13);
-	if (NULL == n)
-		return 0;
-   
-	strcpy(n, serviceName);   
-         
-	const uint8_t* srv_type = _postfixForProtocol(proto);
-	if (srv_type)
-		strcat(n, (const char*)srv_type);
-   
-	_resolveServiceProto = proto;
-	return _initQuery(1, n, timeout);
+int BonjourClass::begin()
+{
+    return begin(MDNS_DEFAULT_NAME);
 }
 
-void BonjourClass::stopDiscoveringService()
+#if defined(HAS_NAME_BROWSING) && HAS_NAME_BROWSING
+
+// starts a lookup, to be sent along with all the others pending.
+// return value: its index in the lookup table, or -1 if there's no room or the name is invalid
+int BonjourClass::_addQuery(MDNSQueryKind_t kind, const char* name, MDNSServiceProtocol_t proto, unsigned long timeout, void* context)
 {
-	_cancelQuery(1);
+    int idx;
+    for (idx = 0; idx < MDNS_MAX_QUERIES; idx++)
+        if (MDNSQueryNone == _queries[idx].kind) break;
+
+    if (idx == MDNS_MAX_QUERIES || NULL == name)
+        return -1;
+
+    MDNSQuery_t* query = &_queries[idx];
+    uint16_t nameLength;
+
+    if (MDNSQueryName != kind)
+        query->name = alloc_wire_name(name, wire_postfix_for_protocol(proto), sizeof(mdnsTcpPostfix), &nameLength);
+    else
+        query->name = alloc_wire_name(name, mdnsTldPostfix, sizeof(mdnsTldPostfix), &nameLength);
+
+    if (NULL == query->name)
+        return -1;
+
+    query->kind = kind;
+    query->proto = proto;
+    query->nameHash = wire_name_hash(query->name);
+    query->nameCallback = NULL;
+    query->serviceCallback = NULL;
+    query->context = context;
+    query->interval = MDNS_QUERY_INTERVAL_MIN;
+
+    if (timeout)
+        _setTimer(MDNSTimerQueryTimeout + idx, millis() + timeout);
+
+    // the question goes out with the next run, together with any others asked by then.
+    // other lookups for the same name start over with it (RFC 6762 5.2).
+    // without a socket, it goes out as soon as there is one.
+    for (int i = 0; i < MDNS_MAX_QUERIES; i++)
+    {
+        MDNSQuery_t* other = &_queries[i];
+        if (kind != other->kind || query->nameHash != other->nameHash || !wire_names_equal(query->name, other->name))
+            continue;
+
+        other->interval = MDNS_QUERY_INTERVAL_MIN;
+        if (MDNSStateProbing <= _state)
+            _setTimer(MDNSTimerQuery + i, millis());
+    }
+
+    return idx;
 }
 
-int BonjourClass::isDiscoveringService()
+void BonjourClass::_cancelQuery(int idx)
 {
-	return (NULL != _resolveNames[1]);
+    MDNSQuery_t* query = &_queries[idx];
+
+    _cancelTimer(MDNSTimerQuery + idx);
+    _cancelTimer(MDNSTimerQueryTimeout + idx);
+
+    if (MDNSQueryNone == query->kind) return;
+
+    for (int i = 0; i < MDNS_MAX_INSTANCES; i++)
+        if (_instances[i].used && idx == _instances[i].query)
+            _instances[i].used = 0;
+
+    if (NULL != query->name)
+        my_free(query->name);
+    memset(query, 0, sizeof(*query));
 }
 
-// return value:
-// A DNSError_t (DNSSuccess on success, something else otherwise)
-// in "int" mode: positive on success, negative on error
-MDNSError_t BonjourClass::_sendMDNSMessage(IPAddress *peerAddress, uint32_t xid, int type, int serviceRecord)
+// cancels the lookups of a kind: those for a name, and those reporting to the callback
+// set for all of them or to one of their own
+void BonjourClass::_cancelQueries(MDNSQueryKind_t kind, const uint8_t* name, uint8_t ownCallback)
 {
-    MDNSError_t statusCode = MDNSSuccess;
-    uint16_t ptr = 0;
-#if defined(_USE_MALLOC_)
-    DNSHeader_t* dnsHeader = NULL;
-#else
-    DNSHeader_t dnsHeaderBuf;
-    DNSHeader_t* dnsHeader = &dnsHeaderBuf;
-#endif
-    uint8_t* buf;
+    for (int i = 0; i < MDNS_MAX_QUERIES; i++) {
+        const MDNSQuery_t* query = &_queries[i];
+        if (kind != query->kind) continue;
+
+        if (NULL != name) {
+            if (query->nameHash == wire_name_hash(name) && wire_names_equal(query->name, name))
+                _cancelQuery(i);
+        }
+        else if (ownCallback == (NULL != query->nameCallback || NULL != query->serviceCallback))
+            _cancelQuery(i);
+    }
+}
+
+int BonjourClass::_anyQueries(MDNSQueryKind_t kind)
+{
+    for (int i = 0; i < MDNS_MAX_QUERIES; i++)
+        if ((MDNSQueryNone == kind) ? (MDNSQueryNone != _queries[i].kind) : (kind == _queries[i].kind))
+            return 1;
+    return 0;
+}
+
+// writes the first labels of a wire format name as a dotted string.
+// a negative label count leaves out that many labels at the end.
+static void wire_name_to_string(const uint8_t* name, int labels, char* out, uint16_t outSize)
+{
+    uint16_t len = 0;
+
+    if (labels < 0) {
+        int count = 0;
+        for (const uint8_t* p = name; *p; p += *p + 1)
+            count++;
+        labels += count;
+    }
+
+    for (; *name && labels > 0; name += *name + 1, labels--) {
+        if (len > 0 && len + 1 < outSize)
+            out[len++] = '.';
+
+        uint16_t labelLen = *name;
+        if (len + labelLen >= outSize)
+            labelLen = outSize - 1 - len;
+
+        memcpy(out + len, name + 1, labelLen);
+        len += labelLen;
+    }
+
+    out[len] = '\0';
+}
+
+// reports the address of a host, or that there's none, which ends its lookup
+void BonjourClass::_reportName(int idx, const byte ipAddr[4])
+{
+    const MDNSQuery_t* query = &_queries[idx];
+    BonjourNameLookupCallback callback = query->nameCallback;
+    void* context = query->context;
+    char name[MDNS_MAX_NAME_LEN];
+
+    // the name is reported without the .local postfix
+    wire_name_to_string(query->name, -1, name, sizeof(name));
+
+    // the callback may start another lookup in its place
+    _cancelQuery(idx);
+
+    if (NULL != callback)
+        callback(name, ipAddr, context);
+    else if (NULL != _nameFoundCallback)
+        _nameFoundCallback(name, ipAddr);
+}
+
+// reports what happened to an instance of a service type, or the end of the lookup if
+// there's no instance name
+void BonjourClass::_reportService(const MDNSQuery_t* query, MDNSServiceEvent_t event, const char* instanceName, const byte ipAddr[4], unsigned short port, const char* txtContent)
+{
+    const uint8_t* type = query->name;
+    char typeName[MDNS_MAX_LABEL_LEN + 1];
+
+    // the service type is reported without the instance name and the protocol postfix
+    if (MDNSQueryInstance == query->kind)
+        type += 1 + type[0];
+    wire_name_to_string(type, -2, typeName, sizeof(typeName));
+
+    // the global callback has no event to tell a removal by, and expects an address with every
+    // instance; it only hears of instances found, and of lookups that timed out
+    if (NULL != query->serviceCallback)
+        query->serviceCallback(typeName, query->proto, event, instanceName, ipAddr, port, txtContent, query->context);
+    else if (NULL != _serviceFoundCallback && (MDNSServiceRemoved != event || NULL == instanceName))
+        _serviceFoundCallback(typeName, query->proto, instanceName, ipAddr, port, txtContent);
+}
+
+// ends a service lookup, and reports its last event
+void BonjourClass::_finishService(int idx, MDNSServiceEvent_t event, const char* instanceName, const byte ipAddr[4], unsigned short port, const char* txtContent)
+{
+    // the callback may start another lookup in its place, so the lookup ends first;
+    // its name is kept for the report
+    MDNSQuery_t query = _queries[idx];
+    _queries[idx].name = NULL;
+    _cancelQuery(idx);
+
+    _reportService(&query, event, instanceName, ipAddr, port, txtContent);
+    my_free(query.name);
+}
+
+// reports a lookup that got no (more) answers in time, and ends it
+void BonjourClass::_queryTimedOut(int idx)
+{
+    if (MDNSQueryName == _queries[idx].kind)
+        _reportName(idx, NULL);
+    else if (MDNSQueryNone != _queries[idx].kind)
+        _finishService(idx, MDNSServiceRemoved, NULL, NULL, 0, NULL);
+}
+
+static uint32_t instance_fingerprint(const byte ipAddr[4], unsigned short port, const char* txtContent)
+{
+    uint32_t hash = MDNS_NAME_HASH_SEED;
+
+    for (int i = 0; i < 4; i++)
+        hash = (hash ^ ipAddr[i]) * MDNS_NAME_HASH_PRIME;
+    hash = (hash ^ (port >> 8)) * MDNS_NAME_HASH_PRIME;
+    hash = (hash ^ (port & 0xff)) * MDNS_NAME_HASH_PRIME;
+
+    for (const char* p = txtContent; NULL != p && *p; p++)
+        hash = (hash ^ (uint8_t)*p) * MDNS_NAME_HASH_PRIME;
+
+    return hash;
+}
+
+MDNSInstance_t* BonjourClass::_findInstance(int idx, const char* name)
+{
+    uint8_t len = strlen(name);
+
+    for (int i = 0; i < MDNS_MAX_INSTANCES; i++) {
+        MDNSInstance_t* instance = &_instances[i];
+        if (instance->used && idx == instance->query && len == strlen(instance->name) &&
+            labels_equal((const uint8_t*)name, (const uint8_t*)instance->name, len))
+            return instance;
+    }
+
+    return NULL;
+}
+
+// an instance was seen in an answer to a service lookup. it's reported if it's new, or if
+// its address, port or TXT record have changed since it was reported last; otherwise, all
+// that changes is when it expires (unless ttl is 0: a record other than its PTR record changed).
+// without an address, only the PTR record was seen.
+void BonjourClass::_foundInstance(int idx, const char* name, const byte ipAddr[4], unsigned short port, const char* txtContent, uint32_t ttl)
+{
+    MDNSInstance_t* instance = _findInstance(idx, name);
+    MDNSServiceEvent_t event = MDNSServiceUpdated;
+
+    if (ttl > MDNS_CACHE_MAX_TTL)
+        ttl = MDNS_CACHE_MAX_TTL;
+
+    if (NULL != instance && 0 != ttl)
+        instance->expires = millis() + ttl * 1000UL;
+
+    if (NULL == ipAddr || strlen(name) >= MDNS_INSTANCE_NAME_SIZE)
+        return;
+
+    if (NULL == instance) {
+        // a full table makes room by forgetting the instance that's heard from least: the
+        // one whose PTR record expires first. if it's seen again, it's reported as new.
+        for (int i = 0; i < MDNS_MAX_INSTANCES; i++)
+            if (!_instances[i].used || NULL == instance ||
+                (instance->used && deadline_before(_instances[i].expires, instance->expires)))
+                instance = &_instances[i];
+
+        instance->used = 1;
+        instance->query = idx;
+        instance->expires = millis() + ttl * 1000UL;
+        strcpy(instance->name, name);
+        event = MDNSServiceAdded;
+    }
+    else if (instance->fingerprint == instance_fingerprint(ipAddr, port, txtContent))
+        return;
+
+    instance->fingerprint = instance_fingerprint(ipAddr, port, txtContent);
+    _expireInstances();
+
+    _reportService(&_queries[idx], event, name, ipAddr, port, txtContent);
+}
+
+// an instance said goodbye (RFC 6762 10.1)
+void BonjourClass::_lostInstance(int idx, const char* name)
+{
+    MDNSInstance_t* instance = _findInstance(idx, name);
+    if (NULL == instance)
+        return;
+
+    instance->used = 0;
+    _reportService(&_queries[idx], MDNSServiceRemoved, name, NULL, 0, NULL);
+}
+
+// reports the instances whose PTR records have expired as removed, and sets the timer for
+// the next one
+void BonjourClass::_expireInstances()
+{
+    unsigned long now = millis();
+    MDNSInstance_t* next = NULL;
+
+    for (int i = 0; i < MDNS_MAX_INSTANCES; i++)
+    {
+        MDNSInstance_t* instance = &_instances[i];
+        if (!instance->used) continue;
+
+        if ((long)(now - instance->expires) >= 0) {
+            // the callback may stop the lookup, or start others
+            instance->used = 0;
+            if (MDNSQueryService == _queries[instance->query].kind)
+                _reportService(&_queries[instance->query], MDNSServiceRemoved, instance->name, NULL, 0, NULL);
+            i = -1;
+            next = NULL;
+        }
+        else if (NULL == next || deadline_before(instance->expires, next->expires))
+            next = instance;
+    }
+
+    if (NULL != next)
+        _setTimer(MDNSTimerInstances, next->expires);
+    else
+        _cancelTimer(MDNSTimerInstances);
+}
+
+// return values:
+// 1 on success
+// 0 otherwise
+int BonjourClass::resolveName(const char* name, unsigned long timeout)
+{   
+	cancelResolveName();
+   
+	if (NULL == _nameFoundCallback)
+		return 0;
+   
+	int idx = _addQuery(MDNSQueryName, name, MDNSServiceTCP, timeout, NULL);
+	if (idx < 0)
+		return 0;
+   
+	_answerFromCache(idx);
+	return 1;
+}
+
+// return values:
+// 1 on success
+// 0 otherwise
+int BonjourClass::resolveName(const char* name, unsigned long timeout, BonjourNameLookupCallback callback, void* context)
+{
+	if (NULL == callback)
+		return 0;
+   
+	int idx = _addQuery(MDNSQueryName, name, MDNSServiceTCP, timeout, context);
+	if (idx < 0)
+		return 0;
+   
+	_queries[idx].nameCallback = callback;
+	_answerFromCache(idx);
+	return 1;
+}
+
+void BonjourClass::setNameResolvedCallback(BonjourNameFoundCallback newCallback)
+{
+   	_nameFoundCallback = newCallback;
+}
+
+void BonjourClass::cancelResolveName()
+{
+   	_cancelQueries(MDNSQueryName, NULL, 0);
+}
+
+void BonjourClass::cancelResolveName(const char* name)
+{
+	uint8_t wireName[MDNS_MAX_NAME_LEN];
+	
+	if (NULL != name && 0 != encode_wire_name(name, mdnsTldPostfix, sizeof(mdnsTldPostfix), wireName, sizeof(wireName)))
+		_cancelQueries(MDNSQueryName, wireName, 0);
+}
+
+int BonjourClass::isResolvingName()
+{
+	return _anyQueries(MDNSQueryName);
+}
+
+void BonjourClass::setServiceFoundCallback(BonjourServiceFoundCallback newCallback)
+{
+	_serviceFoundCallback = newCallback;
+}
+
+// return values:
+// 1 on success
+// 0 otherwise
+int BonjourClass::startDiscoveringService(const char* serviceName, MDNSServiceProtocol_t proto, unsigned long timeout)
+{   
+	stopDiscoveringService();
+   
+	if (NULL == _serviceFoundCallback)
+		return 0;
+   
+	int idx = _addQuery(MDNSQueryService, serviceName, proto, timeout, NULL);
+	if (idx < 0)
+		return 0;
+   
+	_answerFromCache(idx);
+	return 1;
+}
+
+// return values:
+// 1 on success
+// 0 otherwise
+int BonjourClass::startDiscoveringService(const char* serviceName, MDNSServiceProtocol_t proto, unsigned long timeout,
+                                          BonjourServiceLookupCallback callback, void* context)
+{
+	if (NULL == callback)
+		return 0;
+   
+	int idx = _addQuery(MDNSQueryService, serviceName, proto, timeout, context);
+	if (idx < 0)
+		return 0;
+   
+	_queries[idx].serviceCallback = callback;
+	_answerFromCache(idx);
+	return 1;
+}
+
+void BonjourClass::stopDiscoveringService()
+{
+	_cancelQueries(MDNSQueryService, NULL, 0);
+}
+
+void BonjourClass::stopDiscoveringService(const char* serviceName, MDNSServiceProtocol_t proto)
+{
+	uint8_t wireName[MDNS_MAX_NAME_LEN];
+	
+	if (NULL != serviceName && 0 != encode_wire_name(serviceName, wire_postfix_for_protocol(proto), sizeof(mdnsTcpPostfix), wireName, sizeof(wireName)))
+		_cancelQueries(MDNSQueryService, wireName, 0);
+}
+
+int BonjourClass::isDiscoveringService()
+{
+	return _anyQueries(MDNSQueryService);
+}
+
+// return values:
+// 1 on success
+// 0 otherwise
+int BonjourClass::resolveService(const char* instanceName, MDNSServiceProtocol_t proto, unsigned long timeout)
+{
+	cancelResolveService();
+   
+	if (NULL == _serviceFoundCallback)
+		return 0;
+   
+	int idx = _addQuery(MDNSQueryInstance, instanceName, proto, timeout, NULL);
+	if (idx < 0)
+		return 0;
    
+	_answerFromCache(idx);
+	return 1;
+}
+
+// return values:
+// 1 on success
+// 0 otherwise
+int BonjourClass::resolveService(const char* instanceName, MDNSServiceProtocol_t proto, unsigned long timeout,
+                                 BonjourServiceLookupCallback callback, void* context)
+{
+	if (NULL == callback)
+		return 0;
+   
+	int idx = _addQuery(MDNSQueryInstance, instanceName, proto, timeout, context);
+	if (idx < 0)
+		return 0;
+   
+	_queries[idx].serviceCallback = callback;
+	_answerFromCache(idx);
+	return 1;
+}
+
+void BonjourClass::cancelResolveService()
+{
+	_cancelQueries(MDNSQueryInstance, NULL, 0);
+}
+
+void BonjourClass::cancelResolveService(const char* instanceName, MDNSServiceProtocol_t proto)
+{
+	uint8_t wireName[MDNS_MAX_NAME_LEN];
+	
+	if (NULL != instanceName && 0 != encode_wire_name(instanceName, wire_postfix_for_protocol(proto), sizeof(mdnsTcpPostfix), wireName, sizeof(wireName)))
+		_cancelQueries(MDNSQueryInstance, wireName, 0);
+}
+
+int BonjourClass::isResolvingService()
+{
+	return _anyQueries(MDNSQueryInstance);
+}
+
+// return values:
+// 1 on success
+// 0 otherwise
+int BonjourClass::startSnooping()
+{
+	stopSnooping();
+	_snooping = 1;
+	return 1;
+}
+
+// return values:
+// 1 on success
+// 0 otherwise
+int BonjourClass::startSnooping(const char* serviceName, MDNSServiceProtocol_t proto)
+{
+	uint8_t wireName[MDNS_MAX_NAME_LEN];
+	int idx = -1, types = 0;
+	
+	if (NULL == serviceName || 0 == encode_wire_name(serviceName, wire_postfix_for_protocol(proto), sizeof(mdnsTcpPostfix), wireName, sizeof(wireName)))
+		return 0;
+	
+	for (int i = 0; i < MDNS_MAX_SNOOP_TYPES; i++) {
+		if (NULL == _snoopTypes[i]) {
+			if (idx < 0)
+				idx = i;
+		}
+		else if (wire_names_equal(_snoopTypes[i], wireName))
+			return 1;
+		else
+			types++;
+	}
+	
+	// snooping on everything already includes the type
+	if (_snooping && 0 == types)
+		return 1;
+	
+	if (idx < 0)
+		return 0;
+	
+	uint16_t nameLength;
+	_snoopTypes[idx] = alloc_wire_name(serviceName, wire_postfix_for_protocol(proto), sizeof(mdnsTcpPostfix), &nameLength);
+	if (NULL == _snoopTypes[idx])
+		return 0;
+	
+	_snooping = 1;
+	return 1;
+}
+
+void BonjourClass::stopSnooping()
+{
+	for (int i = 0; i < MDNS_MAX_SNOOP_TYPES; i++) {
+		if (NULL != _snoopTypes[i])
+			my_free(_snoopTypes[i]);
+		_snoopTypes[i] = NULL;
+	}
+	
+	_snooping = 0;
+}
+
+// the questions a lookup asks, as record types and names.
+// an instance lookup asks for the address of its host as well, once its SRV record is known.
+// return value: the number of questions
+int BonjourClass::_queryQuestions(int idx, uint16_t types[], const uint8_t* names[])
+{
+    const MDNSQuery_t* query = &_queries[idx];
+
+    names[0] = query->name;
+
+    if (MDNSQueryName == query->kind)
+        types[0] = DNSTypeA;
+    else if (MDNSQueryService == query->kind)
+        types[0] = DNSTypePTR;
+    else {
+        types[0] = DNSTypeSRV;
+        types[1] = DNSTypeTXT;
+        names[1] = query->name;
+
+        const MDNSCacheEntry_t* srv = _findCached(DNSTypeSRV, query->name, 0);
+        if (NULL == srv)
+            return 2;
+
+        types[2] = DNSTypeA;
+        names[2] = srv->data + 6;
+        return 3;
+    }
+
+    return 1;
+}
+
+// the questions of all lookups that are due go out together, in one query packet, or in
+// as few as they fit into. every lookup asks again after twice the time it waited
+// before, up to an hour (RFC 6762 5.2).
+// the answers we already have go along with the questions they answer, so that they aren't
+// sent again (RFC 6762 7.1); if they don't all fit, the packet is marked truncated and the
+// rest follow, before the next of the questions (RFC 6762 7.2).
+// a lookup whose questions don't fit even into an empty packet can't be asked, and ends
+// as if it had timed out.
+// return value:
+// MDNSSuccess if there was anything to ask, MDNSNothingToDo otherwise
+MDNSError_t BonjourClass::_sendQueries()
+{
+    unsigned long now = millis();
+    uint8_t due[MDNS_MAX_QUERIES];
+    uint8_t dropped[MDNS_MAX_QUERIES];
+    uint8_t asked[MDNS_MAX_QUERIES];
+    uint8_t any = 0;
+    uint16_t types[3];
+    const uint8_t* names[3];
+
+    for (int i = 0; i < MDNS_MAX_QUERIES; i++)
+    {
+        const MDNSQuery_t* query = &_queries[i];
+
+        dropped[i] = 0;
+        due[i] = MDNSQueryNone != query->kind &&
+                 (!_timerPending(MDNSTimerQuery + i) || (long)(_timerDeadline(MDNSTimerQuery + i) - now) <= MDNS_QUERY_WINDOW);
+
+        // a name several lookups are waiting for is only asked for once
+        for (int j = 0; j < i && due[i]; j++)
+            if (due[j] && query->kind == _queries[j].kind && query->nameHash == _queries[j].nameHash &&
+                wire_names_equal(query->name, _queries[j].name)) {
+                due[i] = 2;
+                break;
+            }
+
+        any |= due[i];
+    }
+
+    if (!any)
+        return MDNSNothingToDo;
+
+    for (int next = 0; next < MDNS_MAX_QUERIES; )
+    {
+        _startPacket(mdnsMulticastIPAddr, MDNS_SERVER_PORT, 0, 0);
+        memset(asked, 0, sizeof(asked));
+
+        for (; next < MDNS_MAX_QUERIES; next++)
+        {
+            if (1 != due[next]) continue;
+
+            size_t mark = _writeOffset;
+            int n = _queryQuestions(next, types, names);
+            for (int k = 0; k < n; k++)
+                _writeQuestion(names[k], types[k], DNSClassIN);
+
+            if (_writeOverflow) {
+                _truncatePacket(mark);
+
+                // doesn't fit anymore, it goes into the next packet
+                if (_packetCounts[0] > 0)
+                    break;
+
+                // nor would it ever, neither for this lookup nor for the others waiting for the name
+                for (int j = next; j < MDNS_MAX_QUERIES; j++)
+                    if (due[j] && _queries[next].kind == _queries[j].kind && _queries[next].nameHash == _queries[j].nameHash &&
+                        wire_names_equal(_queries[next].name, _queries[j].name)) {
+                        due[j] = 0;
+                        dropped[j] = 1;
+                    }
+                continue;
+            }
+
+            _packetCounts[0] += n;
+            asked[next] = 1;
+        }
+
+        // known answers to the questions in this packet: what we have cached with more than
+        // half of its TTL left. every packet with more of them to follow is marked truncated
+        for (int i = 0; i < MDNS_MAX_QUERIES; i++)
+        {
+            if (!asked[i]) continue;
+
+            int n = _queryQuestions(i, types, names);
+            for (int k = 0; k < n; k++)
+            {
+                for (int c = 0; c < MDNS_CACHE_SIZE; c++)
+                {
+                    const MDNSCacheEntry_t* entry = _findCached(types[k], names[k], c);
+                    if (NULL == entry)
+                        break;
+                    c = entry - _cache;
+
+                    unsigned long left = entry->expires - now;
+                    if (left <= entry->ttl * 500UL)
+                        continue;
+
+                    size_t mark;
+                    do {
+                        mark = _writeOffset;
+                        _writeCachedRecord(entry, left / 1000);
+                    } while (MDNSTryLater == _fitEntry(mark, 1, 1, DNS_FLAG_TC));
+                }
+            }
+        }
+
+        if (_packetCounts[0] + _packetCounts[1] > 0)
+            _finishPacket(0);
+        else
+            _truncatePacket(0);
+    }
+
+    for (int i = 0; i < MDNS_MAX_QUERIES; i++)
+    {
+        if (0 == due[i]) continue;
+
+        MDNSQuery_t* query = &_queries[i];
+        _setTimer(MDNSTimerQuery + i, now + query->interval);
+
+        query->interval *= 2;
+        if (query->interval > MDNS_QUERY_INTERVAL_MAX)
+            query->interval = MDNS_QUERY_INTERVAL_MAX;
+    }
+
+    for (int i = 0; i < MDNS_MAX_QUERIES; i++)
+        if (dropped[i] && MDNSQueryNone != _queries[i].kind)
+            _queryTimedOut(i);
+
+    return MDNSSuccess;
+}
+
+// whether a received record is kept: if it's of use to any of our lookups, or if we're
+// snooping on it
+int BonjourClass::_cacheWants(const MDNSCacheEntry_t* record)
+{
+    return _lookupWants(record) || _snoopWants(record);
+}
+
+// whether a record is of use to any of our lookups: the address of a host we look for,
+// an instance of a service type we look for, the SRV and TXT records of such an instance
+// or of one we look for by name, or the address of its host.
+int BonjourClass::_lookupWants(const MDNSCacheEntry_t* record)
+{
+    // the service type an instance belongs to is its name without the first label
+    const uint8_t* parent = record->name + 1 + record->name[0];
+    if (0 == record->name[0])
+        return 0;
+
+    for (int i = 0; i < MDNS_MAX_QUERIES; i++)
+    {
+        const MDNSQuery_t* query = &_queries[i];
+
+        switch (record->type)
+        {
+            case DNSTypeA:
+                if (MDNSQueryName == query->kind && query->nameHash == record->nameHash && wire_names_equal(query->name, record->name))
+                    return 1;
+                break;
+
+            case DNSTypePTR:
+                if (MDNSQueryService == query->kind && query->nameHash == record->nameHash && wire_names_equal(query->name, record->name))
+                    return 1;
+                break;
+
+            case DNSTypeSRV:
+            case DNSTypeTXT:
+                if (MDNSQueryService == query->kind && wire_names_equal(query->name, parent))
+                    return 1;
+                if (MDNSQueryInstance == query->kind && query->nameHash == record->nameHash && wire_names_equal(query->name, record->name))
+                    return 1;
+                break;
+        }
+    }
+
+    // an address is wanted if it's the target of a cached SRV record
+    if (DNSTypeA == record->type)
+        for (int i = 0; i < MDNS_CACHE_SIZE; i++)
+            if (DNSTypeSRV == _cache[i].type && wire_names_equal(_cache[i].data + 6, record->name))
+                return 1;
+
+    return 0;
+}
+
+// whether a received record is kept while snooping: any record if no service type is given,
+// otherwise the PTR records of the types, and the SRV and TXT records of their instances.
+// the addresses of their hosts are wanted as targets of cached SRV records.
+int BonjourClass::_snoopWants(const MDNSCacheEntry_t* record)
+{
+    const uint8_t* type = record->name;
+    uint8_t filtered = 0;
+
+    if (!_snooping)
+        return 0;
+
+    if (DNSTypeSRV == record->type || DNSTypeTXT == record->type)
+        type += 1 + type[0];
+
+    for (int i = 0; i < MDNS_MAX_SNOOP_TYPES; i++)
+    {
+        if (NULL == _snoopTypes[i]) continue;
+        filtered = 1;
+
+        if (DNSTypeA != record->type && wire_names_equal(_snoopTypes[i], type))
+            return 1;
+    }
+
+    return !filtered;
+}
+
+static int cache_entry_fresh(const MDNSCacheEntry_t* entry, unsigned long now)
+{
+    return 0 != entry->type && !entry->stale && (long)(entry->expires - now) > 0;
+}
+
+// finds the next cached record of a type and name, starting at the given entry.
+// only records that can still be used as answers are found. finding a record doesn't
+// count as using it, see cache_hit().
+MDNSCacheEntry_t* BonjourClass::_findCached(uint16_t type, const uint8_t* name, int from)
+{
+    uint32_t hash = wire_name_hash(name);
+    unsigned long now = millis();
+
+    for (int i = from; i < MDNS_CACHE_SIZE; i++) {
+        MDNSCacheEntry_t* entry = &_cache[i];
+        if (type == entry->type && hash == entry->nameHash && cache_entry_fresh(entry, now) && wire_names_equal(entry->name, name))
+            return entry;
+    }
+
+    return NULL;
+}
+
+// the next time a cached record is asked for again, as a share of its TTL (RFC 6762 5.2)
+static void schedule_refresh(MDNSCacheEntry_t* entry)
+{
+    unsigned long percent = 80 + MDNS_CACHE_REFRESH_STEP * entry->refreshes;
+    entry->refreshAt = entry->received + entry->ttl * 10UL * percent + random(entry->ttl * 10UL * MDNS_CACHE_REFRESH_JITTER + 1);
+}
+
+static int cache_entry_refreshing(const MDNSCacheEntry_t* entry)
+{
+    return !entry->stale && entry->refreshes < MDNS_CACHE_REFRESHES;
+}
+
+// a cached record that answers a lookup counts as used, and is kept longer than those
+// that were only listed as known answers
+static MDNSCacheEntry_t* cache_hit(MDNSCacheEntry_t* entry)
+{
+    if (NULL != entry)
+        entry->lastUsed = millis();
+    return entry;
+}
+
+// adds a received record to the cache, or refreshes it (RFC 6762 10).
+// a TTL of zero is a goodbye, and a record with the cache flush bit set replaces all the
+// others of its name and type; either way, the records go away a second later. when the
+// cache is full, the record used least recently makes room.
+void BonjourClass::_cacheRecord(const MDNSCacheEntry_t* record, uint32_t ttl, uint8_t cacheFlush)
+{
+    unsigned long now = millis();
+    MDNSCacheEntry_t* slot = NULL;
+
+    if (!_cacheWants(record))
+        return;
+
+    if (ttl > MDNS_CACHE_MAX_TTL)
+        ttl = MDNS_CACHE_MAX_TTL;
+
+    for (int i = 0; i < MDNS_CACHE_SIZE; i++)
+    {
+        MDNSCacheEntry_t* entry = &_cache[i];
+        if (record->type != entry->type || record->nameHash != entry->nameHash || !wire_names_equal(record->name, entry->name))
+            continue;
+
+        if (record->dataLength == entry->dataLength && 0 == memcmp(record->data, entry->data, record->dataLength))
+            slot = entry;
+        else if (cacheFlush && (long)(now - entry->received) >= MDNS_CACHE_GRACE_TIME && !entry->stale) {
+            entry->stale = 1;
+            entry->expires = now + MDNS_CACHE_GRACE_TIME;
+        }
+    }
+
+    if (0 == ttl) {
+        if (NULL != slot && !slot->stale) {
+            slot->stale = 1;
+            slot->expires = now + MDNS_CACHE_GRACE_TIME;
+        }
+    }
+    else {
+        if (NULL == slot) {
+            for (int i = 0; i < MDNS_CACHE_SIZE; i++)
+                if (0 == _cache[i].type || NULL == slot || deadline_before(_cache[i].lastUsed, slot->lastUsed)) {
+                    slot = &_cache[i];
+                    if (0 == slot->type) break;
+                }
+            *slot = *record;
+        }
+
+        slot->stale = 0;
+        slot->ttl = ttl;
+        slot->received = now;
+        slot->lastUsed = now;
+        slot->expires = now + ttl * 1000UL;
+        slot->refreshes = 0;
+        schedule_refresh(slot);
+    }
+
+    _expireCache();
+}
+
+// drops the cache entries that have expired, and sets the timer for the next one to
+// expire or to be asked for again
+void BonjourClass::_expireCache()
+{
+    unsigned long now = millis();
+    unsigned long next = 0;
+    uint8_t any = 0;
+
+    for (int i = 0; i < MDNS_CACHE_SIZE; i++)
+    {
+        MDNSCacheEntry_t* entry = &_cache[i];
+        if (0 == entry->type) continue;
+
+        if ((long)(now - entry->expires) >= 0) {
+            entry->type = 0;
+            continue;
+        }
+
+        unsigned long deadline = cache_entry_refreshing(entry) ? entry->refreshAt : entry->expires;
+        if (!any || deadline_before(deadline, next))
+            next = deadline;
+        any = 1;
+    }
+
+    if (any)
+        _setTimer(MDNSTimerCache, next);
+    else
+        _cancelTimer(MDNSTimerCache);
+}
+
+// asks again for the cached records our lookups still want, before they expire: at 80, 85, 90
+// and 95% of their TTL (RFC 6762 5.2). an answer in time refreshes the record, and starts over.
+// records with the same name and type are asked for once.
+void BonjourClass::_refreshCache()
+{
+    unsigned long now = millis();
+    uint8_t asked[MDNS_CACHE_SIZE];
+
+    for (int i = 0; i < MDNS_CACHE_SIZE; i++)
+    {
+        MDNSCacheEntry_t* entry = &_cache[i];
+
+        asked[i] = 0;
+        if (0 == entry->type || !cache_entry_refreshing(entry) || (long)(now - entry->refreshAt) < 0)
+            continue;
+
+        entry->refreshes++;
+        schedule_refresh(entry);
+
+        if (MDNSStateProbing > _state || !_lookupWants(entry))
+            continue;
+
+        asked[i] = 1;
+        for (int j = 0; j < i; j++)
+            if (asked[j] && entry->type == _cache[j].type && entry->nameHash == _cache[j].nameHash &&
+                wire_names_equal(entry->name, _cache[j].name)) {
+                asked[i] = 0;
+                break;
+            }
+        if (!asked[i])
+            continue;
+
+        if (0 == _writeOffset)
+            _startPacket(mdnsMulticastIPAddr, MDNS_SERVER_PORT, 0, 0);
+
+        // what doesn't fit anymore goes into the next packet
+        size_t mark;
+        do {
+            mark = _writeOffset;
+            _writeQuestion(entry->name, entry->type, DNSClassIN);
+        } while (MDNSTryLater == _fitEntry(mark, 0, 1, 0));
+    }
+
+    if (_writeOffset > 0) {
+        if (_packetCounts[0] > 0)
+            _finishPacket(0);
+        else
+            _truncatePacket(0);
+    }
+
+    _expireCache();
+}
+
+// TXT data is kept zero-terminated in the cache, so it's reported from there
+static const char* cached_txt(const MDNSCacheEntry_t* txt)
+{
+    return (NULL == txt || txt->dataLength <= 1) ? NULL : (const char*)txt->data;
+}
+
+// reports what's known about a new lookup from the cache: the address of a host, or of an
+// instance looked for by name, ends its lookup; instances of a service type whose SRV and
+// A records are known are added while the lookup goes on.
+void BonjourClass::_answerFromCache(int idx)
+{
+    const MDNSQuery_t* query = &_queries[idx];
+
+    if (MDNSQueryName == query->kind) {
+        const MDNSCacheEntry_t* a = cache_hit(_findCached(DNSTypeA, query->name, 0));
+        if (NULL != a)
+            _reportName(idx, a->data);
+        return;
+    }
+
+    if (MDNSQueryInstance == query->kind) {
+        MDNSCacheEntry_t* srv = _findCached(DNSTypeSRV, query->name, 0);
+        MDNSCacheEntry_t* a = (NULL != srv) ? _findCached(DNSTypeA, srv->data + 6, 0) : NULL;
+        if (NULL == a)
+            return;
+
+        char instanceName[MDNS_MAX_LABEL_LEN + 1];
+        wire_name_to_string(query->name, 1, instanceName, sizeof(instanceName));
+
+        cache_hit(srv);
+        cache_hit(a);
+        _finishService(idx, MDNSServiceAdded, instanceName, a->data, ((unsigned short)srv->data[4] << 8) | srv->data[5],
+                       cached_txt(cache_hit(_findCached(DNSTypeTXT, query->name, 0))));
+        return;
+    }
+
+    for (int i = 0; i < MDNS_CACHE_SIZE && MDNSQueryService == query->kind; i++)
+    {
+        MDNSCacheEntry_t* ptr = _findCached(DNSTypePTR, query->name, i);
+        if (NULL == ptr)
+            break;
+        i = ptr - _cache;
+
+        MDNSCacheEntry_t* srv = _findCached(DNSTypeSRV, ptr->data, 0);
+        MDNSCacheEntry_t* a = (NULL != srv) ? _findCached(DNSTypeA, srv->data + 6, 0) : NULL;
+        if (NULL == a)
+            continue;
+
+        char instanceName[MDNS_MAX_LABEL_LEN + 1];
+        wire_name_to_string(ptr->data, 1, instanceName, sizeof(instanceName));
+
+        cache_hit(ptr);
+        cache_hit(srv);
+        cache_hit(a);
+        _foundInstance(idx, instanceName, a->data, ((unsigned short)srv->data[4] << 8) | srv->data[5],
+                       cached_txt(cache_hit(_findCached(DNSTypeTXT, ptr->data, 0))), (ptr->expires - millis()) / 1000);
+    }
+}
+
+#endif // defined(HAS_NAME_BROWSING) && HAS_NAME_BROWSING
+
+// an announcement only changes along with the service record, our name or our address,
+// so it's serialized once and sent from a copy after that.
+// return value: the announcement packet, or NULL if it doesn't fit into one packet
+const uint8_t* BonjourClass::_announcementFor(int recordIndex, uint16_t* pLen)
+{
+    MDNSServiceRecord_t* record = _serviceRecords[recordIndex];
+
+    if (NULL == record->announcement)
+    {
+        // the packet is put together in the write buffer, but not sent from there
+        if (_writeOffset > 0)
+            (void)endPacket();
+
+        _writeHeader(0, DNS_FLAG_QR | DNS_FLAG_AA);
+        _writeOwnedRecord(recordIndex, MDNS_ANSWER_SRV, NULL);
+        _writeOwnedRecord(recordIndex, MDNS_ANSWER_TXT, NULL);
+        _writeOwnedRecord(recordIndex, MDNS_ANSWER_SERVICES, NULL);
+        _writeOwnedRecord(recordIndex, MDNS_ANSWER_PTR, NULL);
+        _writeOwnedRecord(-1, MDNS_ANSWER_A, NULL);
+        _writeCounts(0, 4, 0, 1);
+
+        if (!_writeOverflow && NULL != (record->announcement = (uint8_t*)my_malloc(_writeOffset))) {
+            memcpy(record->announcement, _writeBuffer, _writeOffset);
+            record->announcementLength = _writeOffset;
+        }
+
+        _truncatePacket(0);
+    }
+
+    *pLen = record->announcementLength;
+    return record->announcement;
+}
+
+static int same_service_type(const MDNSServiceRecord_t* a, const MDNSServiceRecord_t* b)
+{
+    return a->servNameLength == b->servNameLength && 0 == memcmp(a->servName, b->servName, a->servNameLength);
+}
+
+// announces every service record that's due (RFC 6762 8.3): three times on startup, one
+// and two seconds apart, then again before three quarters of the TTL have passed.
+// refreshes are jittered so that devices powered up together don't stay in step;
+// refreshes that are almost due go along with the ones that are, all in one response.
+// a record whose timer isn't pending anymore is due.
+void BonjourClass::_sendDueAnnouncements()
+{
+    unsigned long now = millis();
+    MDNSAnswerSet_t answers;
+
+    if (MDNSStateAnnouncing != _state) return;
+
+    memset(&answers, 0, sizeof(answers));
+    answers_add(&answers, -1, MDNS_ADDITIONAL(MDNS_ANSWER_A));
+
+    for (int i = 0; i < NumMDNSServiceRecords; i++)
+    {
+        MDNSServiceRecord_t* record = _serviceRecords[i];
+        if (NULL == record) continue;
+
+        long left = _timerPending(MDNSTimerAnnounce + i) ? (long)(_timerDeadline(MDNSTimerAnnounce + i) - now) : 0;
+        if (left > 0 && (record->announceCount < MDNS_STARTUP_ANNOUNCEMENTS || left > MDNS_REFRESH_WINDOW))
+            continue;
+
+        // several instances may share a service type, it's only listed once
+        uint16_t k;
+        for (k = 0; k < answers.count; k++)
+            if (same_service_type(_serviceRecords[answers.listed[k]], record))
+                break;
+
+        answers_add(&answers, i, MDNS_ANSWER_PTR | MDNS_ANSWER_SRV | MDNS_ANSWER_TXT |
+                                 ((k == answers.count) ? MDNS_ANSWER_SERVICES : 0));
+
+        if (record->announceCount < MDNS_STARTUP_ANNOUNCEMENTS)
+            record->announceCount++;
+
+        if (record->announceCount < MDNS_STARTUP_ANNOUNCEMENTS)
+            _setTimer(MDNSTimerAnnounce + i, now + (MDNS_STARTUP_INTERVAL << (record->announceCount - 1)));
+        else
+            _setTimer(MDNSTimerAnnounce + i, now + MDNS_REFRESH_INTERVAL - random(MDNS_REFRESH_JITTER));
+    }
+
+    MDNSResponseTarget_t target;
+    memset(&target, 0, sizeof(target));
+    (void)_sendMDNSResponse(&answers, &target);
+}
+
+// restarts the startup announcements, e.g. after our name has changed
+void BonjourClass::_restartAnnouncements()
+{
+    for (int i = 0; i < NumMDNSServiceRecords; i++) {
+        if (NULL == _serviceRecords[i]) continue;
+        _serviceRecords[i]->announceCount = 0;
+        _setTimer(MDNSTimerAnnounce + i, millis());
+    }
+}
+
+void BonjourClass::_addServiceTypeAnswers(MDNSAnswerSet_t* answers)
+{
+    for (int i = 0; i < NumMDNSServiceRecords; i++)
+    {
+        if (NULL == _serviceRecords[i]) continue;
+
+        // several instances may share a service type, it's only listed once
+        int j;
+        for (j = 0; j < i; j++)
+            if (NULL != _serviceRecords[j] && same_service_type(_serviceRecords[j], _serviceRecords[i]))
+                break;
+
+        if (j == i)
+            answers_add(answers, i, MDNS_ANSWER_SERVICES);
+    }
+}
+
+static uint8_t count_bits(uint8_t flags)
+{
+    uint8_t n = 0;
+    for (; flags; flags &= flags - 1)
+        n++;
+    return n;
+}
+
+static uint8_t any_answers(const MDNSAnswerSet_t* answers)
+{
+    uint8_t flags = answers->host;
+
+    for (uint16_t k = 0; k < answers->count; k++)
+        flags |= answers->records[answers->listed[k]];
+
+    return flags & 0x0f;
+}
+
+// PTR records are shared: other hosts may hold records of the same name and type
+static uint8_t any_shared_answers(const MDNSAnswerSet_t* answers)
+{
+    uint8_t flags = 0;
+
+    for (uint16_t k = 0; k < answers->count; k++)
+        flags |= answers->records[answers->listed[k]];
+
+    return flags & (MDNS_ANSWER_PTR | MDNS_ANSWER_SERVICES);
+}
+
+static void merge_answers(MDNSAnswerSet_t* answers, const MDNSAnswerSet_t* more)
+{
+    answers->host |= more->host;
+    for (uint16_t k = 0; k < more->count; k++)
+        answers_add(answers, more->listed[k], more->records[more->listed[k]]);
+}
+
+// whether two answer sets hold the same records, in the same sections
+static int same_answers(const MDNSAnswerSet_t* a, const MDNSAnswerSet_t* b)
+{
+    if (a->host != b->host || a->count != b->count)
+        return 0;
+
+    for (uint16_t k = 0; k < a->count; k++)
+        if (a->records[a->listed[k]] != b->records[a->listed[k]])
+            return 0;
+
+    return 1;
+}
+
+// the announcement of a service record answers with its PTR, SRV and TXT records and the
+// DNS-SD PTR, and adds our address. it's what's owed when the record is announced alone.
+// return value: the index of the service record, or -1
+static int announced_record_answer(const MDNSAnswerSet_t* answers)
+{
+    const uint8_t announced = MDNS_ANSWER_PTR | MDNS_ANSWER_SRV | MDNS_ANSWER_TXT | MDNS_ANSWER_SERVICES;
+
+    if (MDNS_ADDITIONAL(MDNS_ANSWER_A) != answers->host || 1 != answers->count ||
+        announced != (answers->records[answers->listed[0]] & 0x0f))
+        return -1;
+
+    return answers->listed[0];
+}
+
+// additional records are of no use without an answer to go with
+static void drop_lone_additionals(MDNSAnswerSet_t* answers)
+{
+    if (!any_answers(answers))
+        answers_clear(answers);
+}
 
-#if defined(_USE_MALLOC_)
-    dnsHeader = (DNSHeader_t*)my_malloc(sizeof(DNSHeader_t));
-    if (NULL == dnsHeader) {
-        statusCode = MDNSOutOfMemory;
-        goto errorReturn;
+// removes known answers (and the additional records that came with them) from the answer set.
+// return value: the number of answers dropped
+int BonjourClass::_suppressKnownAnswers(MDNSAnswerSet_t* answers, const MDNSAnswerSet_t* known)
+{
+    int suppressed = 0;
+
+    for (int k = -1; k < answers->count; k++)
+    {
+        int i = answers_record(answers, k);
+        uint8_t* flags = (i < 0) ? &answers->host : &answers->records[i];
+        uint8_t knownFlags = (i < 0) ? known->host : known->records[i];
+
+        // SRV and TXT only come as additional records to our PTR;
+        // if the querier knows the PTR, they're not needed either
+        if (i >= 0 && (knownFlags & *flags & MDNS_ANSWER_PTR))
+            knownFlags |= MDNS_ANSWER_SRV | MDNS_ANSWER_TXT;
+
+        uint8_t remaining = *flags & ~(knownFlags | MDNS_ADDITIONAL(knownFlags));
+        suppressed += count_bits((*flags ^ remaining) & 0x0f);
+        *flags = remaining;
     }
-#endif
-      
-    memset(dnsHeader, 0, sizeof(DNSHeader_t));
-   
-    dnsHeader->xid = htons(xid);
-    dnsHeader->opCode = DNSOpQuery;
-   
-    switch (type) 
+
+    answers_compact(answers);
+    drop_lone_additionals(answers);
+    return suppressed;
+}
+
+unsigned long* BonjourClass::_lastMulticastFor(int recordIndex, uint8_t what)
+{
+    uint8_t bit = 0;
+    while (what > 1) {
+        what >>= 1;
+        bit++;
+    }
+
+    if (recordIndex < 0)
+        return &_hostLastMulticast[bit];
+    return &_serviceRecords[recordIndex]->lastMulticast[bit];
+}
+
+// removes records that were multicast less than the given interval ago (RFC 6762 6).
+// repeated questions within the interval are answered by the packet that already went out.
+void BonjourClass::_rateLimitAnswers(MDNSAnswerSet_t* answers, unsigned long interval)
+{
+    unsigned long now = millis();
+
+    for (int k = -1; k < answers->count; k++)
+    {
+        int i = answers_record(answers, k);
+        uint8_t* flags = (i < 0) ? &answers->host : &answers->records[i];
+
+        for (uint8_t what = 0x01; what <= 0x08; what <<= 1)
+        {
+            if (0 == (*flags & (what | MDNS_ADDITIONAL(what)))) continue;
+
+            if (now - *_lastMulticastFor(i, what) < interval)
+                *flags &= ~(what | MDNS_ADDITIONAL(what));
+        }
+    }
+
+    answers_compact(answers);
+    drop_lone_additionals(answers);
+}
+
+// RFC 6762 5.4: a unicast response is only worth it if the records were multicast
+// within the last quarter of their TTL, otherwise other hosts' caches need a refresh
+// as well. in that case the whole unicast response is multicast instead.
+void BonjourClass::_checkUnicastAnswers(MDNSAnswerSet_t* unicastAnswers, MDNSAnswerSet_t* answers)
+{
+    unsigned long now = millis();
+    uint8_t stale = 0;
+
+    for (int k = -1; k < unicastAnswers->count && !stale; k++)
+    {
+        int i = answers_record(unicastAnswers, k);
+        uint8_t flags = (i < 0) ? unicastAnswers->host : unicastAnswers->records[i];
+
+        for (uint8_t what = 0x01; what <= 0x08; what <<= 1)
+            if ((flags & what) && now - *_lastMulticastFor(i, what) >= 1000UL * MDNS_RESPONSE_TTL / 4)
+                stale = 1;
+    }
+
+    if (!stale) return;
+
+    merge_answers(answers, unicastAnswers);
+    answers_clear(unicastAnswers);
+}
+
+// multicast answers made of unique records only are sent right away. if there are shared
+// records among them, other hosts may be answering as well, so the response is delayed
+// by 20-120ms (RFC 6762 6). until then, shared answers owed to other queries are merged into it.
+void BonjourClass::_scheduleResponse(const MDNSAnswerSet_t* answers)
+{
+    if (!any_answers(answers)) return;
+
+    if (!any_shared_answers(answers)) {
+        MDNSResponseTarget_t target;
+        memset(&target, 0, sizeof(target));
+        (void)_sendMDNSResponse(answers, &target);
+        return;
+    }
+
+    if (!any_answers(&_scheduledAnswers))
+        _setTimer(MDNSTimerResponse, millis() + random(MDNS_SHARED_DELAY_MIN, MDNS_SHARED_DELAY_MAX + 1));
+
+    merge_answers(&_scheduledAnswers, answers);
+}
+
+void BonjourClass::_sendScheduledResponse()
+{
+    // the link may have gone away in the meantime
+    if (!any_answers(&_scheduledAnswers) || MDNSStateAnnouncing != _state) {
+        answers_clear(&_scheduledAnswers);
+        return;
+    }
+
+    MDNSResponseTarget_t target;
+    memset(&target, 0, sizeof(target));
+    (void)_sendMDNSResponse(&_scheduledAnswers, &target);
+
+    answers_clear(&_scheduledAnswers);
+}
+
+// starts a response packet, and counts the questions it repeats
+void BonjourClass::_beginResponse(const MDNSResponseTarget_t* target)
+{
+    if (NULL != target->peerAddress)
+        _startPacket(*target->peerAddress, target->peerPort, target->xid, DNS_FLAG_QR | DNS_FLAG_AA);
+    else
+        _startPacket(mdnsMulticastIPAddr, MDNS_SERVER_PORT, target->xid, DNS_FLAG_QR | DNS_FLAG_AA);
+
+    if (0 == target->questionsLength)
+        return;
+
+    // the questions land at the same offset they had in the query,
+    // so any compression pointers within them stay valid.
+    // if they don't fit into the write buffer, they aren't repeated at all
+    _writeBytes(_readBuffer + DNS_HEADER_SIZE, target->questionsLength);
+    if (_writeOverflow)
+        _truncatePacket(DNS_HEADER_SIZE);
+    else
+        _packetCounts[0] = target->questionCount;
+}
+
+// writes one of the records we own; a negative record index stands for our host.
+// legacy unicast resolvers get short TTLs, and no cache flush bits (RFC 6762 6.7);
+// goodbyes have a TTL of zero (RFC 6762 10.1)
+void BonjourClass::_writeOwnedRecord(int recordIndex, uint8_t what, const MDNSResponseTarget_t* target)
+{
+    uint8_t legacy = (NULL != target && target->legacy);
+    uint32_t ttl = legacy ? MDNS_LEGACY_TTL : MDNS_RESPONSE_TTL;
+
+    if (NULL != target && target->goodbye)
+        ttl = 0;
+
+    if (recordIndex < 0) {
+        if (MDNS_ANSWER_NSEC == what)
+            _writeNSEC(_bonjourName, ttl, !legacy);
+        else
+            _writeA(_bonjourName, ttl, !legacy);
+        return;
+    }
+
+    const MDNSServiceRecord_t* record = _serviceRecords[recordIndex];
+
+    switch (what)
     {
-        case MDNSPacketTypeServiceRecordRelease:
-        case MDNSPacketTypeMyIPAnswer:
-            dnsHeader->answerCount = htons(1);
-            dnsHeader->queryResponse = 1;
-            dnsHeader->authoritiveAnswer = 1;
+        case MDNS_ANSWER_PTR:
+            _writePTR(record->servName, record->name, ttl);
             break;
-        case MDNSPacketTypeServiceRecord:
-            dnsHeader->answerCount = htons(4);
-            dnsHeader->additionalCount = htons(1);
-            dnsHeader->queryResponse = 1;
-            dnsHeader->authoritiveAnswer = 1;
+        case MDNS_ANSWER_SRV:
+            _writeSRV(record->name, record->port, _bonjourName, ttl, !legacy);
             break;
-        case MDNSPacketTypeNameQuery:
-        case MDNSPacketTypeServiceQuery:
-            dnsHeader->queryCount = htons(1);
+        case MDNS_ANSWER_TXT:
+            _writeTXT(record->name, record->textContent, record->textLength, ttl, !legacy);
             break;
-        case MDNSPacketTypeNoIPv6AddrAvailable:
-            dnsHeader->queryCount = htons(1);
-            dnsHeader->additionalCount = htons(1);
-            dnsHeader->responseCode = 0x03;
-            dnsHeader->authoritiveAnswer = 1;
-            dnsHeader->queryResponse = 1;
+        case MDNS_ANSWER_SERVICES:
+            _writePTR(mdnsServicesName, record->servName, ttl);
             break;
     }
+}
 
+// answers to the same records are the same packet, too, as long as nothing changes in
+// between. the last response sent, other than an announcement, is kept along with the
+// records it holds. the write buffer still holds the packet, which has just been sent.
+void BonjourClass::_keepResponse(const MDNSAnswerSet_t* answers, uint16_t length)
+{
+    if (NULL != _cachedResponse)
+        my_free(_cachedResponse);
 
-    beginPacket(mdnsMulticastIPAddr, MDNS_SERVER_PORT);
-    write((uint8_t*)dnsHeader, sizeof(DNSHeader_t));
+    answers_clear(&_cachedResponseAnswers);
+    if (NULL == (_cachedResponse = (uint8_t*)my_malloc(length)))
+        return;
 
-    ptr += sizeof(DNSHeader_t);
-    buf = (uint8_t*)dnsHeader;
-   
-    // construct the answer section
-    switch (type) 
-    {
-        case MDNSPacketTypeMyIPAnswer: 
-        {
-            _writeMyIPAnswerRecord(&ptr, buf, sizeof(DNSHeader_t));
-            break;
+    memcpy(_cachedResponse, _writeBuffer, length);
+    _cachedResponseLength = length;
+    merge_answers(&_cachedResponseAnswers, answers);
+}
+
+void BonjourClass::_invalidateCachedResponses()
+{
+    for (int i = 0; i < NumMDNSServiceRecords; i++) {
+        if (NULL == _serviceRecords[i] || NULL == _serviceRecords[i]->announcement) continue;
+        my_free(_serviceRecords[i]->announcement);
+        _serviceRecords[i]->announcement = NULL;
+    }
+
+    if (NULL != _cachedResponse) {
+        my_free(_cachedResponse);
+        _cachedResponse = NULL;
+    }
+    answers_clear(&_cachedResponseAnswers);
+}
+
+// sends a response from a copy, if there's one holding exactly the records owed: the
+// announcement of a service record, or the last response. a copy never holds anything
+// that isn't owed, so what the rate limit took out of the answers stays out.
+// return value:
+// MDNSSuccess if the response was sent, MDNSNotFound if there's no copy to send it from
+MDNSError_t BonjourClass::_sendCachedResponse(const MDNSAnswerSet_t* answers, const MDNSResponseTarget_t* target)
+{
+    const uint8_t* packet = NULL;
+    uint16_t len = 0;
+
+    IPAddress myIp = WiFi.localIP();
+    if (myIp[0] != _announcedIP[0] || myIp[1] != _announcedIP[1] || myIp[2] != _announcedIP[2] || myIp[3] != _announcedIP[3]) {
+        _invalidateCachedResponses();
+        for (uint8_t i = 0; i < 4; i++)
+            _announcedIP[i] = myIp[i];
+    }
+
+    int announced = announced_record_answer(answers);
+    if (announced >= 0 && NULL != _serviceRecords[announced])
+        packet = _announcementFor(announced, &len);
+    else if (NULL != _cachedResponse && same_answers(answers, &_cachedResponseAnswers)) {
+        packet = _cachedResponse;
+        len = _cachedResponseLength;
+    }
+
+    if (NULL == packet)
+        return MDNSNotFound;
+
+    if (NULL != target->peerAddress)
+        beginPacket(*target->peerAddress, target->peerPort);
+    else
+        beginPacket(mdnsMulticastIPAddr, MDNS_SERVER_PORT);
+    UDP::write(packet, len);
+
+    if (NULL == target->peerAddress) {
+        unsigned long now = millis();
+
+        for (int k = -1; k < answers->count; k++) {
+            int i = answers_record(answers, k);
+            uint8_t flags = (i < 0) ? answers->host : answers->records[i];
+
+            for (uint8_t what = 0x01; what <= 0x08; what <<= 1)
+                if (flags & (what | MDNS_ADDITIONAL(what)))
+                    *_lastMulticastFor(i, what) = now;
         }
+    }
 
-#if defined(HAS_SERVICE_REGISTRATION) && HAS_SERVICE_REGISTRATION
-      
-        case MDNSPacketTypeServiceRecord: 
+    return MDNSSuccess;
+}
+
+// sends all records owed for one incoming packet: answers first, then the additional
+// records that weren't answered already. everything is packed into as few packets
+// as the write buffer allows; a record is never split between packets.
+// legacy resolvers only read one packet: what doesn't fit into it is left out, and if
+// that includes answers, the packet is marked as truncated (multicast DNS responses
+// never are, RFC 6762 18.5).
+// return value:
+// A DNSError_t (DNSSuccess on success, something else otherwise)
+MDNSError_t BonjourClass::_sendMDNSResponse(const MDNSAnswerSet_t* answers, const MDNSResponseTarget_t* target)
+{
+    uint8_t started = 0;
+    uint8_t truncated = 0;
+    uint8_t packets = 0;
+
+    // legacy responses repeat the query's id and questions, goodbyes are rare
+    uint8_t cacheable = !target->legacy && !target->goodbye;
+    if (cacheable && MDNSSuccess == _sendCachedResponse(answers, target))
+        return MDNSSuccess;
+
+    for (int section = 0; section < 2; section++)
+    {
+        for (int k = -1; k < answers->count; k++)
         {
-            // SRV location record
-            _writeServiceRecordName(serviceRecord, &ptr, buf, sizeof(DNSHeader_t), 0);
-         
-            buf[0] = 0x00;
-            buf[1] = 0x21;    // SRV record
-            buf[2] = 0x80;    // cache flush
-            buf[3] = 0x01;    // class IN
-         
-            // ttl
-            *((uint32_t*)&buf[4]) = htonl(MDNS_RESPONSE_TTL);
-         
-            // data length
-            *((uint16_t*)&buf[8]) = htons(8 + strlen((char*)_bonjourName));
-
-            write((uint8_t*)buf, 10);
-            ptr += 10;
-            // priority and weight
-            buf[0] = buf[1] = buf[2] = buf[3] = 0;
-         
-            // port
-            *((uint16_t*)&buf[4]) = htons(_serviceRecords[serviceRecord]->port);
-         
-            write((uint8_t*)buf, 6);
-            ptr += 6;
-            // target
-            _writeDNSName(_bonjourName, &ptr, buf, sizeof(DNSHeader_t), 1);
-         
-            // TXT record
-            _writeServiceRecordName(serviceRecord, &ptr, buf, sizeof(DNSHeader_t), 0);
-         
-            buf[0] = 0x00;
-            buf[1] = 0x10;    // TXT record
-            buf[2] = 0x80;    // cache flush
-            buf[3] = 0x01;    // class IN
-         
-            // ttl
-            *((uint32_t*)&buf[4]) = htonl(MDNS_RESPONSE_TTL);
-
-            write((uint8_t*)buf, 8);
-            ptr += 8;
-         
-            // data length && text
-            if (NULL == _serviceRecords[serviceRecord]->textContent) {
-                buf[0] = 0x00;
-                buf[1] = 0x01;
-                buf[2] = 0x00;
-                
-                write((uint8_t*)buf, 3);
-                ptr += 3;
-            } else {
-                int slen = strlen((const char*)_serviceRecords[serviceRecord]->textContent);
-                *((uint16_t*)buf) = htons(slen);
-                write((uint8_t*)buf, 2);
-                ptr += 2;
-    
-                write((uint8_t*)_serviceRecords[serviceRecord]->textContent, slen);
-                ptr += slen;
+            int i = answers_record(answers, k);
+            uint8_t flags = (i < 0) ? answers->host : answers->records[i];
+
+            if (i >= 0 && NULL == _serviceRecords[i]) continue;
+
+            if (0 == section)
+                flags &= 0x0f;
+            else
+                flags = (flags >> 4) & ~flags;
+
+            for (uint8_t what = 0x01; what <= 0x08; what <<= 1)
+            {
+                if (0 == (flags & what)) continue;
+
+                if (!started) {
+                    _beginResponse(target);
+                    started = 1;
+                }
+
+                MDNSError_t fit;
+                for (;;) {
+                    size_t mark = _writeOffset;
+                    _writeOwnedRecord(i, what, target);
+
+                    if (MDNSTryLater != (fit = _fitEntry(mark, (0 == section) ? 1 : 3, !target->legacy, 0)))
+                        break;
+                    packets++;
+                }
+
+                if (MDNSSuccess != fit) {
+                    truncated |= target->legacy && 0 == section;
+                    continue;
+                }
+
+                if (NULL == target->peerAddress)
+                    *_lastMulticastFor(i, what) = millis();
             }
-         
-            // PTR record (for the dns-sd service in general)
-            _writeDNSName((const uint8_t*)DNS_SD_SERVICE, &ptr, buf, sizeof(DNSHeader_t), 1);
-         
-            buf[0] = 0x00;
-            buf[1] = 0x0c;    // PTR record
-            buf[2] = 0x00;    // no cache flush
-            buf[3] = 0x01;    // class IN
-         
-            // ttl
-            *((uint32_t*)&buf[4]) = htonl(MDNS_RESPONSE_TTL);
-         
-            // data length.
-            uint16_t dlen = strlen((char*)_serviceRecords[serviceRecord]->servName) + 2;
-            *((uint16_t*)&buf[8]) = htons(dlen);
-            
-            write((uint8_t*)buf, 10);
-            ptr += 10;
-         
-            _writeServiceRecordName(serviceRecord, &ptr, buf, sizeof(DNSHeader_t), 1);
-         
-            // PTR record (our service)
-            _writeServiceRecordPTR(serviceRecord, &ptr, buf, sizeof(DNSHeader_t), MDNS_RESPONSE_TTL);
-         
-            // finally, our IP address as additional record
-            _writeMyIPAnswerRecord(&ptr, buf, sizeof(DNSHeader_t));
-            break;
         }
-      
-        case MDNSPacketTypeServiceRecordRelease: 
-        {
-            // just send our service PTR with a TTL of zero
-            _writeServiceRecordPTR(serviceRecord, &ptr, buf, sizeof(DNSHeader_t), 0);
-            break;
+    }
+
+    if (started) {
+        if (_packetCounts[1] + _packetCounts[3] > 0 || truncated) {
+            uint16_t length = _writeOffset;
+            _finishPacket(truncated ? DNS_FLAG_TC : 0);
+
+            // announcements have copies of their own
+            if (cacheable && 0 == packets && announced_record_answer(answers) < 0)
+                _keepResponse(answers, length);
         }
-      
-#endif // defined(HAS_SERVICE_REGISTRATION) && HAS_SERVICE_REGISTRATION
+        else
+            _truncatePacket(0);
+    }
+
+    return MDNSSuccess;
+}
+
+// whether a response has a record for the given name that isn't our A record, i.e. whether
+// somebody else uses the name. the reader is a copy, positioned right after the header.
+static int claims_name(MDNSReader_t reader, uint16_t qCnt, uint16_t rCnt, const uint8_t* name, IPAddress myIp)
+{
+    for (uint16_t i = 0; i < qCnt && !reader.error; i++) {
+        (void)reader_read_name_hash(&reader);
+        reader_skip(&reader, 4);
+    }
+
+    for (uint16_t i = 0; i < rCnt && !reader.error; i++)
+    {
+        uint16_t namePos = reader.pos;
+        (void)reader_read_name_hash(&reader);
+
+        uint16_t rType = reader_read_u16(&reader);
+        reader_skip(&reader, 6); // class, ttl
+        uint16_t dataLen = reader_read_u16(&reader);
+        const uint8_t* rdata = reader_read_bytes(&reader, dataLen);
+
+        if (NULL == rdata || !packet_name_equals(&reader, namePos, name))
+            continue;
+
+        if (DNSTypeA != rType || 4 != dataLen ||
+            rdata[0] != myIp[0] || rdata[1] != myIp[1] || rdata[2] != myIp[2] || rdata[3] != myIp[3])
+            return 1;
+    }
+
+    return 0;
+}
 
 #if defined(HAS_NAME_BROWSING) && HAS_NAME_BROWSING
-    
-        case MDNSPacketTypeNameQuery:
-        case MDNSPacketTypeServiceQuery: 
+
+// decodes a received A, PTR, SRV or TXT record for the cache.
+// return values:
+// 1 if it's one of those, and fits into a cache entry
+// 0 otherwise
+static int decode_record(const MDNSReader_t* r, uint16_t namePos, uint16_t type, uint16_t dataPos, uint16_t dataLen,
+                         MDNSCacheEntry_t* record)
+{
+    memset(record, 0, sizeof(*record));
+    record->type = type;
+
+    if (0 == packet_name_decode(r, namePos, record->name, sizeof(record->name)))
+        return 0;
+    record->nameHash = wire_name_hash(record->name);
+
+    switch (type)
+    {
+        case DNSTypeA:
+        case DNSTypeTXT:
+            if ((DNSTypeA == type && 4 != dataLen) || dataLen > sizeof(record->data))
+                return 0;
+            memcpy(record->data, r->data + dataPos, dataLen);
+            record->dataLength = dataLen;
+            return 1;
+
+        case DNSTypePTR:
+            record->dataLength = packet_name_decode(r, dataPos, record->data, sizeof(record->data));
+            return (0 != record->dataLength);
+
+        case DNSTypeSRV:
+            // priority, weight and port, then the target
+            if (dataLen <= 6)
+                return 0;
+            memcpy(record->data, r->data + dataPos, 6);
+            record->dataLength = packet_name_decode(r, dataPos + 6, record->data + 6, sizeof(record->data) - 6);
+            if (0 == record->dataLength)
+                return 0;
+            record->dataLength += 6;
+            return 1;
+
+        default:
+            return 0;
+    }
+}
+
+// the instance name is the first label of the PTR target.
+// return values:
+// 1 on success
+// 0 if the target doesn't start with a label
+static int instance_label(const MDNSReader_t* r, const MDNSRecordView_t* ptr, char* out)
+{
+    const uint8_t* rdata = r->data + ptr->dataPos;
+
+    if (ptr->dataLen < 2 || 0 == rdata[0] || rdata[0] > MDNS_MAX_LABEL_LEN || 1 + rdata[0] >= ptr->dataLen)
+        return 0;
+
+    memcpy(out, rdata + 1, rdata[0]);
+    out[rdata[0]] = '\0';
+    return 1;
+}
+
+// finds the first record of a type and name among the records of a packet, following
+// compression pointers in both names. goodbyes don't count.
+// return values:
+// 1 if there's one
+// 0 otherwise
+static int find_record(const MDNSReader_t* records, uint16_t count, uint16_t type, const uint8_t* name,
+                       MDNSRecordView_t* found)
+{
+    MDNSReader_t r = *records;
+    uint32_t hash = wire_name_hash(name);
+
+    for (uint16_t i = 0; i < count && reader_read_record(&r, found); i++)
+        if (type == found->type && hash == found->nameHash && 0 != found->ttl &&
+            DNSClassIN == (found->rclass & ~DNS_CLASS_CACHE_FLUSH) && packet_name_equals(&r, found->namePos, name))
+            return 1;
+
+    return 0;
+}
+
+// keeps the records of a response we may be asked for again, before the lookups they answer
+// are done. addresses go last, since they may be wanted for SRV records of the same packet.
+void BonjourClass::_cacheRecords(const MDNSReader_t* records, uint16_t count)
+{
+    MDNSCacheEntry_t record;
+    MDNSRecordView_t rec;
+
+    for (uint8_t addresses = 0; addresses < 2; addresses++)
+    {
+        MDNSReader_t r = *records;
+
+        for (uint16_t i = 0; i < count && reader_read_record(&r, &rec); i++)
         {
-            // construct a query for the currently set _resolveNames[0]
-            _writeDNSName(
-               (type == MDNSPacketTypeServiceQuery) ? _resolveNames[1] : _resolveNames[0],
-               &ptr, buf, sizeof(DNSHeader_t), 1);
-
-            buf[0] = buf[2] = 0x0;
-            buf[1] = (type == MDNSPacketTypeServiceQuery) ? 0x0c : 0x01; 
-            buf[3] = 0x1;
-
-            write((uint8_t*)buf, sizeof(DNSHeader_t));
-            ptr += sizeof(DNSHeader_t);
-         
-            _resolveLastSendMillis[(type == MDNSPacketTypeServiceQuery) ? 1 : 0] = millis();
-            break;
+            if (addresses != (DNSTypeA == rec.type) || DNSClassIN != (rec.rclass & ~DNS_CLASS_CACHE_FLUSH))
+                continue;
+
+            if (decode_record(&r, rec.namePos, rec.type, rec.dataPos, rec.dataLen, &record))
+                _cacheRecord(&record, rec.ttl, 0 != (rec.rclass & DNS_CLASS_CACHE_FLUSH));
         }
-      
-#endif // defined(HAS_NAME_BROWSING) && HAS_NAME_BROWSING
-      
-        case MDNSPacketTypeNoIPv6AddrAvailable: 
-        {
-            // since the Spark doesn't have IPv6, we will respond with a Not Found message
-            _writeDNSName(_bonjourName, &ptr, buf, sizeof(DNSHeader_t), 1);
-         
-            buf[0] = buf[2] = 0x0;
-            buf[1] = 0x1c; // AAAA record
-            buf[3] = 0x01;
-
-            write((uint8_t*)buf, 4);
-            ptr += 4;
-         
-            // send our IPv4 address record as additional record, in case the peer wants it.
-            _writeMyIPAnswerRecord(&ptr, buf, sizeof(DNSHeader_t));
-            break;
+    }
+}
+
+// what's known about an instance once its records are joined. TXT content in the packet
+// is reported in place, and ends where txtEnd points.
+typedef struct _MDNSJoinedInstance_t {
+   uint16_t       port;
+   const uint8_t* ipAddr;
+   const char*    txtContent;
+   uint8_t*       txtEnd;
+} MDNSJoinedInstance_t;
+
+// joins an instance with its SRV and TXT records, and the SRV record with the A record of
+// its host, by their full names; what the packet doesn't have may be cached from earlier
+// ones. nothing is copied: the instance is reported straight from the receive buffer or the
+// cache. the name buffer holds the full name of the instance, and is reused for its host.
+void BonjourClass::_joinInstance(const MDNSReader_t* records, uint16_t count, uint8_t* name, uint16_t nameSize,
+                                 MDNSJoinedInstance_t* joined)
+{
+    MDNSRecordView_t found;
+    const MDNSCacheEntry_t* cached;
+    const uint8_t* target = NULL;
+    uint16_t targetPos = 0;
+
+    memset(joined, 0, sizeof(*joined));
+
+    if (find_record(records, count, DNSTypeSRV, name, &found) && found.dataLen > 6) {
+        joined->port = ((uint16_t)records->data[found.dataPos + 4] << 8) | records->data[found.dataPos + 5];
+        targetPos = found.dataPos + 6;
+    }
+    else if (NULL != (cached = cache_hit(_findCached(DNSTypeSRV, name, 0)))) {
+        joined->port = ((uint16_t)cached->data[4] << 8) | cached->data[5];
+        target = cached->data + 6;
+    }
+
+    if (find_record(records, count, DNSTypeTXT, name, &found)) {
+        if (found.dataLen > 1) {
+            joined->txtContent = (const char*)_readBuffer + found.dataPos;
+            joined->txtEnd = _readBuffer + found.dataPos + found.dataLen;
         }
     }
+    else
+        joined->txtContent = cached_txt(cache_hit(_findCached(DNSTypeTXT, name, 0)));
 
-    endPacket();
+    // the instance name is done with, the name of its host takes its place
+    if (0 != targetPos && 0 != packet_name_decode(records, targetPos, name, nameSize))
+        target = name;
 
-#if defined(_USE_MALLOC_)
-errorReturn:
+    if (NULL != target && 0 != target[0]) {
+        if (find_record(records, count, DNSTypeA, target, &found) && 4 == found.dataLen)
+            joined->ipAddr = records->data + found.dataPos;
+        else if (NULL != (cached = cache_hit(_findCached(DNSTypeA, target, 0))))
+            joined->ipAddr = cached->data;
+    }
+}
 
-    if (NULL != dnsHeader)
-        my_free(dnsHeader);
-#endif
-   
-	return statusCode;
+// reports a joined instance to a lookup. without an address, a browsed instance is only
+// refreshed, and an instance looked for by name waits for its next question, which asks for
+// the address as well. the first complete answer ends its lookup.
+void BonjourClass::_reportJoined(int idx, const char* instanceName, const MDNSJoinedInstance_t* joined, uint32_t ttl)
+{
+    // a TXT record in the packet is terminated in place (the receive buffer has a byte to
+    // spare for that), and restored for the records that follow
+    uint8_t saved = 0;
+    if (NULL != joined->txtEnd) {
+        saved = *joined->txtEnd;
+        *joined->txtEnd = '\0';
+    }
+
+    if (MDNSQueryService == _queries[idx].kind)
+        _foundInstance(idx, instanceName, joined->ipAddr, joined->port, joined->txtContent, ttl);
+    else if (NULL != joined->ipAddr)
+        _finishService(idx, MDNSServiceAdded, instanceName, joined->ipAddr, joined->port, joined->txtContent);
+
+    if (NULL != joined->txtEnd)
+        *joined->txtEnd = saved;
+}
+
+// reports the instances of a response: PTR answers for service lookups, and SRV records
+// for instance lookups.
+void BonjourClass::_reportInstances(const MDNSReader_t* records, uint16_t answerCount, uint16_t count)
+{
+    MDNSReader_t instances = *records;
+    MDNSRecordView_t rec;
+
+    for (uint16_t i = 0; i < count && reader_read_record(&instances, &rec); i++)
+    {
+        MDNSQueryKind_t kind = (DNSTypePTR == rec.type && i < answerCount) ? MDNSQueryService :
+                               (DNSTypeSRV == rec.type) ? MDNSQueryInstance : MDNSQueryNone;
+        uint8_t joined = 0;
+
+        char instanceName[MDNS_MAX_LABEL_LEN + 1];
+        uint8_t name[MDNS_MAX_NAME_LEN];        // of the instance, then of its host
+        MDNSJoinedInstance_t instance;
+
+        if (MDNSQueryNone == kind || 0 == rec.ttl || DNSClassIN != (rec.rclass & ~DNS_CLASS_CACHE_FLUSH))
+            continue;
+
+        for (int q = 0; q < MDNS_MAX_QUERIES; q++)
+        {
+            const MDNSQuery_t* query = &_queries[q];
+
+            if (kind != query->kind || query->nameHash != rec.nameHash ||
+                !packet_name_equals(&instances, rec.namePos, query->name))
+                continue;
+
+            if (!joined) {
+                joined = 1;
+                if (0 == packet_name_decode(&instances, (MDNSQueryService == kind) ? rec.dataPos : rec.namePos, name, sizeof(name)) ||
+                    0 == name[0])
+                    break;
+                wire_name_to_string(name, 1, instanceName, sizeof(instanceName));
+                _joinInstance(records, count, name, sizeof(name), &instance);
+            }
+
+            _reportJoined(q, instanceName, &instance, rec.ttl);
+        }
+    }
+}
+
+// an instance that's already been reported may change without a PTR answer: a peer may send
+// just a new TXT or SRV record, or a new address for its host (RFC 6762 8.4). every browsed
+// instance with records in the response is joined again, and reported if it has changed;
+// when its PTR record expires stays the same.
+void BonjourClass::_recheckInstances(const MDNSReader_t* records, uint16_t count)
+{
+    for (int i = 0; i < MDNS_MAX_INSTANCES; i++)
+    {
+        const MDNSInstance_t* instance = &_instances[i];
+        const MDNSQuery_t* query = &_queries[instance->query];
+        char instanceName[MDNS_INSTANCE_NAME_SIZE];
+        uint8_t name[MDNS_MAX_NAME_LEN];        // of the instance, then of its host
+        uint16_t labelLen, typeLen;
+        MDNSRecordView_t found;
+        MDNSJoinedInstance_t joined;
+        const MDNSCacheEntry_t* srv;
+
+        if (!instance->used || MDNSQueryService != query->kind)
+            continue;
+
+        // the full name is the instance label, which may hold dots, followed by the service type
+        labelLen = strlen(instance->name);
+        typeLen = wire_name_length(query->name);
+        if (1U + labelLen + typeLen > sizeof(name))
+            continue;
+        name[0] = labelLen;
+        memcpy(name + 1, instance->name, labelLen);
+        memcpy(name + 1 + labelLen, query->name, typeLen);
+
+        if (!find_record(records, count, DNSTypeSRV, name, &found) && !find_record(records, count, DNSTypeTXT, name, &found) &&
+            (NULL == (srv = _findCached(DNSTypeSRV, name, 0)) || !find_record(records, count, DNSTypeA, srv->data + 6, &found)))
+            continue;
+
+        // the callback may stop the lookup, which drops the instance
+        strcpy(instanceName, instance->name);
+        _joinInstance(records, count, name, sizeof(name), &joined);
+        _reportJoined(instance->query, instanceName, &joined, 0);
+    }
 }
 
+#endif // defined(HAS_NAME_BROWSING) && HAS_NAME_BROWSING
+
 // return value:
 // A DNSError_t (DNSSuccess on success, something else otherwise)
 // in "int" mode: positive on success, negative on error
 MDNSError_t BonjourClass::_processMDNSQuery()
 {
     MDNSError_t statusCode = MDNSSuccess;
-#if defined(_USE_MALLOC_)
-    DNSHeader_t* dnsHeader = NULL;
-#else
-    DNSHeader_t dnsHeaderBuf;
-    DNSHeader_t* dnsHeader = &dnsHeaderBuf;
-#endif
-    uint8_t* buf;
-    uint32_t xid;
+    MDNSReader_t reader;
+    uint16_t flags = 0;
+    uint32_t xid = 0;
     uint16_t udp_len, qCnt, aCnt, aaCnt, addCnt;
-    uint8_t recordsAskedFor[NumMDNSServiceRecords+2];
+    MDNSAnswerSet_t* answers = &_queryAnswers;
+    MDNSAnswerSet_t* unicastAnswers = &_queryUnicastAnswers;
+    MDNSAnswerSet_t* known = &_queryKnownAnswers;
     uint8_t recordsFound[2];
-    uint8_t wantsIPv6Addr = 0;
-    uint8_t * udpBuffer = NULL;
-    uintptr_t ptr;
+    uint8_t legacy = 0;
+    uint16_t questionsLength = 0;
 
-    memset(recordsAskedFor, 0, sizeof(uint8_t)*(NumMDNSServiceRecords+2));
+    // whatever the last query left costs as much to clear as it took to fill
+    answers_clear(answers);
+    answers_clear(unicastAnswers);
+    answers_clear(known);
     memset(recordsFound, 0, sizeof(uint8_t)*2);
 
+    // nothing arrived, nothing to answer
     udp_len = parsePacket();
-    if (0 == udp_len) {
-        statusCode = MDNSTryLater;
-        goto errorReturn;
-    }
+    if (0 == udp_len)
+        return MDNSTryLater;
 
-    udpBuffer = (uint8_t*) my_malloc(udp_len);  //allocate memory to hold _remaining UDP packet
-    read(udpBuffer, udp_len);
-    ptr = (uintptr_t)udpBuffer;
+    // the packet is parsed in place; whatever doesn't fit into the receive buffer
+    // is dropped, and the reader refuses to go past what we actually got
+    if (udp_len > MDNS_READ_BUFFER_SIZE)
+        udp_len = MDNS_READ_BUFFER_SIZE;
 
-#if defined(_USE_MALLOC_)
-    dnsHeader = (DNSHeader_t*)my_malloc(sizeof(DNSHeader_t));
-    if (NULL == dnsHeader) {
-        statusCode = MDNSOutOfMemory;
+    reader_init(&reader, _readBuffer, read(_readBuffer, udp_len));
+
+    xid = reader_read_u16(&reader);
+    flags = reader_read_u16(&reader);
+    qCnt = reader_read_u16(&reader);
+    aCnt = reader_read_u16(&reader);
+    aaCnt = reader_read_u16(&reader);
+    addCnt = reader_read_u16(&reader);
+
+    if (reader.error) {
+        statusCode = MDNSServerError;
         goto errorReturn;
     }
-#endif
 
-    buf = (uint8_t*)dnsHeader;
-    memcpy((uint8_t*)buf, (uint16_t*)ptr ,sizeof(DNSHeader_t));
-   
-    xid = ntohs(dnsHeader->xid);
-    qCnt = ntohs(dnsHeader->queryCount);
-    aCnt = ntohs(dnsHeader->answerCount);
-    aaCnt = ntohs(dnsHeader->authorityCount);
-    addCnt = ntohs(dnsHeader->additionalCount);
+    if (MDNSStateProbing == _state && 0 != (flags & DNS_FLAG_QR) &&
+        claims_name(reader, qCnt, aCnt + aaCnt + addCnt, _bonjourName, WiFi.localIP()))
+        _renameAfterConflict();
 
-    if (0 == dnsHeader->queryResponse && DNSOpQuery == dnsHeader->opCode && MDNS_SERVER_PORT == remotePort())
+    // we don't answer for our names until we know they're ours
+    if (0 == (flags & DNS_FLAG_QR) && DNSOpQuery == DNS_FLAGS_OPCODE(flags) && MDNSStateAnnouncing == _state)
     {
-        // process an MDNS query
-        int offset = sizeof(DNSHeader_t);
-        uint8_t* buf = (uint8_t*)dnsHeader;
-        int rLen = 0, tLen = 0;
-
-        // read over the query section 
-        for (uint16_t i = 0; i < qCnt; i++) 
-        {         
-            // construct service name data structures for comparison
-            const uint8_t* servNames[NumMDNSServiceRecords+2];
-            int servLens[NumMDNSServiceRecords+2];
-            uint8_t servNamePos[NumMDNSServiceRecords+2];
-            uint8_t servMatches[NumMDNSServiceRecords+2];
-         
-            // first entry is our own MDNS name, the rest are our services
-            servNames[0] = (const uint8_t*)_bonjourName;
-            servNamePos[0] = 0;
-            servLens[0] = strlen((char*)_bonjourName);
-            servMatches[0] = 1;
-         
-            // second entry is our own the general DNS-SD service
-            servNames[1] = (const uint8_t*)DNS_SD_SERVICE;
-            servNamePos[1] = 0;
-            servLens[1] = strlen((char*)DNS_SD_SERVICE);
-            servMatches[1] = 1;
-                  
-            for (uint8_t j = 2; j < NumMDNSServiceRecords + 2; j++)
+        // process an MDNS query.
+        // queries not coming from the mDNS port are sent by simple resolvers that
+        // expect a plain unicast DNS response (RFC 6762 6.7)
+        legacy = (MDNS_SERVER_PORT != remotePort());
+
+        // read over the query section
+        for (uint16_t i = 0; i < qCnt && !reader.error; i++)
+        {
+            uint16_t namePos = reader.pos;
+            uint32_t nameHash = reader_read_name_hash(&reader);
+
+            uint16_t qType = reader_read_u16(&reader);
+            uint16_t qClass = reader_read_u16(&reader);
+
+            if (reader.error)
+                break;
+
+            if (DNSClassIN != (qClass & ~DNS_CLASS_UNICAST_RESPONSE))
+                continue;
+
+            // look the name up among the ones we own, and note which records we owe for it:
+            // an A record for our own name, PTR records for the general DNS-SD service or
+            // one of our service types, SRV/TXT records for one of our service instances.
+            // everything owed for this packet is sent together once all questions are read;
+            // questions with the QU bit set are collected separately for a unicast response.
+            uint8_t unicast = legacy || (0 != (qClass & DNS_CLASS_UNICAST_RESPONSE));
+            MDNSAnswerSet_t* owedSet = unicast ? unicastAnswers : answers;
+
+            for (int k = nameHash % MDNS_NAME_INDEX_SIZE; MDNSNameNone != _nameIndex[k].kind; k = (k + 1) % MDNS_NAME_INDEX_SIZE)
             {
-                if (NULL != _serviceRecords[j-2] && NULL != _serviceRecords[j-2]->servName) {
-                    servNames[j] = _serviceRecords[j-2]->servName;
-                    servLens[j] = strlen((char*)servNames[j]);
-                    servMatches[j] = 1;
-                    servNamePos[j] = 0;
-                } else {
-                    servNames[j] = NULL;
-                    servLens[j] = 0;
-                    servMatches[j] = 0;
-                    servNamePos[j] = 0;
-                }
-            }
-            
-            tLen = 0;
-            do {
-        	    memcpy((uint8_t*)buf, (uint16_t*)(ptr+offset), 1);
-                offset += 1;
-                
-                rLen = buf[0];
-                tLen += 1;
-            
-                if (rLen > 128) { // handle DNS name compression, kinda, sorta
-            	    memcpy((uint8_t*)buf, (uint16_t*)(ptr+offset) ,1);
-            	    offset += 1;
-               
-                    for (uint8_t j = 0; j < NumMDNSServiceRecords + 2; j++) {
-                        if (servNamePos[j] && servNamePos[j] != buf[0]) {
-                            servMatches[j] = 0;
+                const MDNSNameIndexEntry_t* entry = &_nameIndex[k];
+
+                if (entry->hash != nameHash || !packet_name_equals(&reader, namePos, _nameForIndexEntry(entry)))
+                    continue;
+
+                switch (entry->kind)
+                {
+                    case MDNSNameHost:
+                        if (DNSTypeA == qType || DNSTypeANY == qType)
+                            owedSet->host |= MDNS_ANSWER_A;
+                        else if (DNSTypeAAAA == qType)
+                            owedSet->host |= MDNS_ANSWER_NSEC | MDNS_ADDITIONAL(MDNS_ANSWER_A);
+                        break;
+
+                    case MDNSNameServices:
+                        if (DNSTypePTR == qType || DNSTypeANY == qType)
+                            _addServiceTypeAnswers(owedSet);
+                        break;
+
+                    case MDNSNameServiceType:
+                        if (DNSTypePTR == qType || DNSTypeANY == qType) {
+                            answers_add(owedSet, entry->record, MDNS_ANSWER_PTR | MDNS_ADDITIONAL(MDNS_ANSWER_SRV | MDNS_ANSWER_TXT));
+                            owedSet->host |= MDNS_ADDITIONAL(MDNS_ANSWER_A);
                         }
-                    }
-               
-                    tLen += 1;
-                } else if (rLen > 0) {
-                    int tr = rLen, ir;
-               
-                    while (tr > 0) {
-                        ir = ((size_t)tr > sizeof(DNSHeader_t)) ? sizeof(DNSHeader_t) : tr;
-
-                        memcpy((uint8_t*)buf, (uint16_t*)(ptr+offset) ,ir);
-                        offset += ir;
-                        tr -= ir;
-                  
-                        for (uint8_t j = 0; j < NumMDNSServiceRecords + 2; j++) {
-                            if (!recordsAskedFor[j] && servMatches[j])
-                                servMatches[j] &= _matchStringPart(&servNames[j], &servLens[j], buf, ir);
+                        break;
+
+                    case MDNSNameServiceInstance:
+                        if (DNSTypeSRV == qType || DNSTypeANY == qType) {
+                            answers_add(owedSet, entry->record, MDNS_ANSWER_SRV);
+                            owedSet->host |= MDNS_ADDITIONAL(MDNS_ANSWER_A);
                         }
-                    }
-               
-                    tLen += rLen;
-                }
-            } while (rLen > 0 && rLen <= 128);
-            
-            // if this matched a name of ours (and there are no characters left), then
-            // check whether this is an A record query (for our own name) or a PTR record query
-            // (for one of our services).
-            // if so, we'll note to send a record
-            
-            memcpy((uint8_t*)buf, (uint16_t*)(ptr+offset), 4);
-            offset += 4;
-         
-            for (uint8_t j = 0; j < NumMDNSServiceRecords + 2; j++) 
-            {
-                if (!recordsAskedFor[j] && servNames[j] && servMatches[j] && 0 == servLens[j]) 
-                {
-                    if (0 == servNamePos[j])
-                        servNamePos[j] = offset - 4 - tLen;
-               
-                    if (buf[0] == 0 && buf[3] == 0x01 && (buf[2] == 0x00 || buf[2] == 0x80)) 
-                    {
-                        if ((0 == j && 0x01 == buf[1]) || (0 < j && (0x0c == buf[1] || 0x10 == buf[1] || 0x21 == buf[1])))
-                            recordsAskedFor[j] = 1;
-                        else if (0 == j && 0x1c == buf[1])
-                            wantsIPv6Addr = 1;
-                    }
+                        if (DNSTypeTXT == qType || DNSTypeANY == qType)
+                            answers_add(owedSet, entry->record, MDNS_ANSWER_TXT);
+                        break;
                 }
             }
         }
-    } 
-   
-#if (defined(HAS_SERVICE_REGISTRATION) && HAS_SERVICE_REGISTRATION) || (defined(HAS_NAME_BROWSING) && HAS_NAME_BROWSING)
 
-    else if (1 == dnsHeader->queryResponse && DNSOpQuery == dnsHeader->opCode && MDNS_SERVER_PORT == remotePort() && 
-        (NULL != _resolveNames[0] || NULL != _resolveNames[1]))
-    {
-        int offset = sizeof(DNSHeader_t);
-        uint8_t* buf = (uint8_t*)dnsHeader;
-        int rLen = 0, tLen = 0;
-         
-        uint8_t* ptrNames[MDNS_MAX_SERVICES_PER_PACKET];
-        uint16_t ptrOffsets[MDNS_MAX_SERVICES_PER_PACKET];
-        uint16_t ptrPorts[MDNS_MAX_SERVICES_PER_PACKET];
-        uint8_t ptrIPs[MDNS_MAX_SERVICES_PER_PACKET];
-        uint8_t servIPs[MDNS_MAX_SERVICES_PER_PACKET][5];
-        uint8_t* servTxt[MDNS_MAX_SERVICES_PER_PACKET];
-        memset(servIPs, 0, sizeof(uint8_t)*MDNS_MAX_SERVICES_PER_PACKET*5);
-        memset(servTxt, 0, sizeof(uint8_t*)*MDNS_MAX_SERVICES_PER_PACKET);
-         
-        const uint8_t* ptrNamesCmp[MDNS_MAX_SERVICES_PER_PACKET];
-        int ptrLensCmp[MDNS_MAX_SERVICES_PER_PACKET];
-        uint8_t ptrNamesMatches[MDNS_MAX_SERVICES_PER_PACKET];
-         
-        uint8_t checkAARecords = 0;
-        memset(ptrNames, 0, sizeof(uint8_t*)*MDNS_MAX_SERVICES_PER_PACKET);
-         
-        const uint8_t* servNames[2];
-        uint8_t servNamePos[2];
-        int servLens[2];
-        uint8_t servMatches[2];
-        uint8_t firstNamePtrByte = 0;
-        uint8_t partMatched[2];
-        uint8_t lastWasCompressed[2];
-        uint8_t servWasCompressed[2];
-         
-		servNamePos[0] = servNamePos[1] = 0;
-                  
-		for (uint16_t i = 0; i < qCnt + aCnt + aaCnt + addCnt; i++) 
-		{
-            for (uint8_t j = 0; j < 2; j++) {
-               if (NULL != _resolveNames[j]) {
-                  servNames[j] = _resolveNames[j];
-                  servLens[j] = strlen((const char*)_resolveNames[j]);
-                  servMatches[j] = 1;
-               } else {
-                  servNames[j] = NULL;
-                  servLens[j] = servMatches[j] = 0;
-               }
-            }
-            
-            for (uint8_t j = 0; j < MDNS_MAX_SERVICES_PER_PACKET; j++) {
-               if (NULL != ptrNames[j]) {
-                  ptrNamesCmp[j] = ptrNames[j];
-                  ptrLensCmp[j] = strlen((const char*)ptrNames[j]);
-                  ptrNamesMatches[j] = 1;
-               }
-            }
-            
-            partMatched[0] = partMatched[1] = 0;
-            lastWasCompressed[0] = lastWasCompressed[1] = 0;
-            servWasCompressed[0] = servWasCompressed[1] = 0;
-            firstNamePtrByte = 0;
-            tLen = 0;
-                        
-            do {
-            	memcpy((uint8_t*)buf, (uint16_t*)(ptr+offset) ,1);
-               	offset += 1;
-               	rLen = buf[0];
-               	tLen += 1;
-            
-               	if (rLen > 128) { // handle DNS name compression, kinda, sorta...
-
-                	memcpy((uint8_t*)buf, (uint16_t*)(ptr+offset) ,1);
-                  	offset += 1;
-
-                  	for (uint8_t j = 0; j < 2; j++) {
-                    	if (servNamePos[j] && servNamePos[j] != buf[0])
-                        	servMatches[j] = 0;
-                     	else
-                        	servWasCompressed[j] = 1;
-                     
-                     	lastWasCompressed[j] = 1;
-                  	}
-               
-                  	tLen += 1;
-                  
-                  	if (0 == firstNamePtrByte)
-                    	firstNamePtrByte = buf[0];
-               } else if (rLen > 0) {
-               		if (i < qCnt)
-                    	offset += rLen;
-                	else {
-                    	int tr = rLen, ir;
-                     
-                    	if (0 == firstNamePtrByte)
-                        	firstNamePtrByte = offset - 1; // -1, since we already read length (1 byte)
-               
-                    	while (tr > 0) {
-                        	ir = ((size_t)tr > sizeof(DNSHeader_t)) ? sizeof(DNSHeader_t) : tr;
-                        	memcpy((uint8_t*)buf, (uint16_t*)(ptr+offset) ,ir);
-                        	offset += ir;
-                        	tr -= ir;
-                  
-                        	for (uint8_t j = 0; j < 2; j++) {
-                           		if (!recordsFound[j] && servMatches[j] && servNames[j])
-                              		servMatches[j] &= _matchStringPart(&servNames[j], &servLens[j], buf, ir);
-                              	if (!partMatched[j])
-                                	partMatched[j] = servMatches[j];
-                              
-                              	lastWasCompressed[j] = 0;
-                        	}         
-                        
-                        	for (uint8_t j = 0; j < MDNS_MAX_SERVICES_PER_PACKET; j++) {
-                           		if (NULL != ptrNames[j] && ptrNamesMatches[j]) {
-                            		// only compare the part we have. this is incorrect, but good enough,
-                            		// since actual MDNS implementations won't go here anyways, as they
-                            		// should use name compression. This is just so that multiple Arduinos
-                            		// running this MDNSResponder code should be able to find each other's
-                            		// services.
-                            		if (ptrLensCmp[j] >= ir) 
-                                 		ptrNamesMatches[j] &= _matchStringPart(&ptrNamesCmp[j], &ptrLensCmp[j], buf, ir);
-                           		}
-                       		}
-                     	}                    
-                     
-                     	tLen += rLen;
-                  	}
-               	}
-            } while (rLen > 0 && rLen <= 128);
-                        
-            // if this matched a name of ours (and there are no characters left), then
-            // check wether this is an A record query (for our own name) or a PTR record query
-            // (for one of our services).
-            // if so, we'll note to send a record
-            if (i < qCnt)
-               	offset += 4;
-            else if (i >= qCnt) 
-            {               
-               	if (i >= qCnt + aCnt && !checkAARecords) break;
-               
-               	uint8_t packetHandled = 0;
-
-               	memcpy((uint8_t*)buf, (uint16_t*)(ptr+offset) ,4);
-               	offset += 4;
-               	if (i < qCnt + aCnt) 
-               	{
-                  	for (uint8_t j = 0; j < 2; j++) 
-                  	{
-                    	if (0 == servNamePos[j])
-                        	servNamePos[j] = offset - 4 - tLen;
-                                      
-                    	if (servNames[j] && ((servMatches[j] && 0 == servLens[j]) || (partMatched[j] && lastWasCompressed[j]) || (servWasCompressed[j] && servMatches[j]))) 
-                        { 
-                        	// somewhat handle compression by guessing                 
-                        	if (buf[0] == 0 && buf[1] == ((0 == j) ? 0x01 : 0x0c) &&
-                           		(buf[2] == 0x00 || buf[2] == 0x80) && buf[3] == 0x01) 
-                           	{
-                           		recordsFound[j] = 1;
-                           		
-                           		// this is an A or PTR type response. Parse it as such.
-                           		memcpy((uint8_t*)buf, (uint16_t*)(ptr+offset) ,6);
-                           		offset += 6;
-                           		//uint32_t ttl = ntohl(*(uint32_t*)buf);
-                           		uint16_t dataLen = ntohs(*(uint16_t*)&buf[4]);
-                        
-                           		if (0 == j && 4 == dataLen) 
-                           		{
-                              		// ok, this is the IP address. report it via callback.
-
-                        	   		memcpy((uint8_t*)buf, (uint16_t*)(ptr+offset) ,4);
-                              		_finishedResolvingName((char*)this->_resolveNames[0], (const byte*)buf);
-                           		} 
-                           		else if (1 == j) 
-                           		{
-                              		uint8_t k;
-                              		for (k = 0; k < MDNS_MAX_SERVICES_PER_PACKET; k++)
-                                 		if (NULL == ptrNames[k]) break;
-                           
-                              		if (k < MDNS_MAX_SERVICES_PER_PACKET) {
-                                 		int l = dataLen - 2; // -2: data compression of service postfix
-                              
-                                 		uint8_t* ptrName = (uint8_t*)my_malloc(l);
-                              
-                                 		if (ptrName) {
-                                			memcpy((uint8_t*)buf, (uint16_t*)(ptr+offset) ,1);
-                                	 		memcpy((uint8_t*)ptrName, (uint16_t*)(ptr+offset+1) ,l-1);
-                                 
-                                    		if (buf[0] < l-1)
-                                       			(void)ptrName[buf[0]]; // this catches uncompressed names
-                                    		else
-                                       			ptrName[l-1] = '\0';
-                                    
-                                    		ptrNames[k] = ptrName;
-                                    		ptrOffsets[k] = (uint16_t)(offset);
- 
-                                    		checkAARecords = 1;
-                                 		}
-                              		}
-                           		}
-                           		offset += dataLen;
-                           		packetHandled = 1;
-                        	}
-                     	}
-                  	}
-               	} 
-               	else if (i >= qCnt + aCnt + aaCnt) 
-               	{
-                	// check whether we find a service description
-                	if (buf[1] == 0x21) 
-                	{
-                    	for (uint8_t j = 0; j < MDNS_MAX_SERVICES_PER_PACKET; j++) 
-                    	{
-                        	if (ptrNames[j] && ((firstNamePtrByte && firstNamePtrByte == ptrOffsets[j]) || (0 == ptrLensCmp[j] && ptrNamesMatches[j]))) 
-                        	{
-                        		// we have found the matching SRV location packet to a previous SRV domain
-                        		memcpy((uint8_t*)buf, (uint16_t*)(ptr+offset) ,6);
-                           		offset += 6;
-
-                           		//uint32_t ttl = ntohl(*(uint32_t*)buf);
-                          		uint16_t dataLen = ntohs(*(uint16_t*)&buf[4]);
-
-                           		if (dataLen >= 8) 
-                           		{
-                           			memcpy((uint8_t*)buf, (uint16_t*)(ptr+offset) ,8);
-                              		ptrPorts[j] = ntohs(*(uint16_t*)&buf[4]);
-                              
-                              		if (buf[6] > 128) { // target is a compressed name
-                                 		ptrIPs[j] = buf[7];
-                              		} else { // target is uncompressed
-                                 		ptrIPs[j] = offset+6;
-                              		}
-                           		}
-                           		offset += dataLen;
-                           		packetHandled = 1;
-                           		break;
-                        	}
-                     	}
-                 	} 
-                 	else if (buf[1] == 0x10) 
-                 	{ 
-                 		// txt record
-                     	for (uint8_t j = 0; j < MDNS_MAX_SERVICES_PER_PACKET; j++) 
-                     	{
-                        	if (ptrNames[j] && ((firstNamePtrByte && firstNamePtrByte == ptrOffsets[j]) || (0 == ptrLensCmp[j] && ptrNamesMatches[j]))) 
-                        	{
-                        		memcpy((uint8_t*)buf, (uint16_t*)(ptr+offset) ,6);
-                           		offset += 6;
-
-                           		//uint32_t ttl = ntohl(*(uint32_t*)buf);
-                           		uint16_t dataLen = ntohs(*(uint16_t*)&buf[4]);
-                        
-                           		// if there's a content to this txt record, save it for delivery
-                           		if (dataLen > 1 && NULL == servTxt[j]) 
-                           		{
-                              		servTxt[j] = (uint8_t*)my_malloc(dataLen+1);
-                              		if (NULL != servTxt[j]) {
-                              			memcpy((uint8_t*)servTxt[j], (uint16_t*)(ptr+offset) ,dataLen);
-                              
-                                 		// zero-terminate
-                                 		servTxt[j][dataLen] = '\0';
-                              		}
-                           		}
-                           		
-                           		offset += dataLen;
-                           		packetHandled = 1;
-                           		break;
-                        	}
-                     	}
-                  	} 
-                  	else if (buf[1] == 0x01) 
-                  	{ 
-                  		// A record (IPv4 address)                     
-                     	for (uint8_t j = 0; j < MDNS_MAX_SERVICES_PER_PACKET; j++) 
-                     	{
-                        	if (0 == servIPs[j][0]) 
-                        	{
-                           		servIPs[j][0] = firstNamePtrByte ? firstNamePtrByte : 255;
-                           		
-                           		memcpy((uint8_t*)buf, (uint16_t*)(ptr+offset) ,6);
-                           		offset += 6;
-
-                           		uint16_t dataLen = ntohs(*(uint16_t*)&buf[4]);
-                           		if (4 == dataLen) {
-                        	  		memcpy((uint8_t*)&servIPs[j][1], (uint16_t*)(ptr+offset) ,4);
-                           		}
-                           		
-                           		offset += dataLen;
-                           		packetHandled = 1;
-                           		break;
-                        	}
-                     	}
-                  	}
-               	}
-               
-               	// eat the answer
-               	if (!packetHandled) {
-            		offset += 4; // ttl
-            		memcpy((uint8_t*)buf, (uint16_t*)(ptr+offset), 2);
-            		offset += 2 + ntohs(*(uint16_t*)buf); // skip over content
-               	}
-            }
-		}
-         
-    	// deliver the services discovered in this packet
-        if (NULL != this->_resolveNames[1]) 
+        // a legacy response repeats the questions, so they must have been read completely
+        if (legacy && reader.error)
+            answers_clear(unicastAnswers);
+        questionsLength = reader.pos - DNS_HEADER_SIZE;
+
+        // read over the answer section: these are the records the querier already knows.
+        // whatever of ours is listed there with at least half of its TTL left is not sent again.
+        for (uint16_t i = 0; i < aCnt && !reader.error; i++)
         {
-        	char* typeName = (char*)this->_resolveNames[1];
-            char* p = (char*)this->_resolveNames[1];
-            while (*p && *p != '.') p++;
-            *p = '\0';
-            
-            for (uint8_t i = 0; i < MDNS_MAX_SERVICES_PER_PACKET; i++)
+            uint16_t namePos = reader.pos;
+            uint32_t nameHash = reader_read_name_hash(&reader);
+
+            uint16_t rType = reader_read_u16(&reader);
+            uint16_t rClass = reader_read_u16(&reader);
+            uint32_t ttl = reader_read_u32(&reader);
+            uint16_t dataLen = reader_read_u16(&reader);
+            uint16_t dataPos = reader.pos;
+            const uint8_t* rdata = reader_read_bytes(&reader, dataLen);
+
+            if (NULL == rdata)
+                break;
+
+            if (DNSClassIN != (rClass & ~DNS_CLASS_CACHE_FLUSH) || ttl < MDNS_RESPONSE_TTL / 2)
+                continue;
+
+            for (int k = nameHash % MDNS_NAME_INDEX_SIZE; MDNSNameNone != _nameIndex[k].kind; k = (k + 1) % MDNS_NAME_INDEX_SIZE)
             {
-            	if (NULL == ptrNames[i]) continue;
-
-				const uint8_t* ipAddr = NULL;
-				const uint8_t* fallbackIpAddr = NULL;
-
-				for (uint8_t j = 0; j < MDNS_MAX_SERVICES_PER_PACKET; j++) 
-				{
-					if (servIPs[j][0] == ptrIPs[i] || servIPs[j][0] == 255) {
-						// the || part is such a hack, but it will work as long as there's only
-						// one A record per MDNS packet. fucking DNS name compression.                     
-						ipAddr = &servIPs[j][1];
-						break;
-					} 
-					else if (NULL == fallbackIpAddr && 0 != servIPs[j][0]) {
-						fallbackIpAddr = &servIPs[j][1];
-					}
-				}
-		   
-				// if we can't find a matching IP, we try to use the first one we found.
-				if (NULL == ipAddr) ipAddr = fallbackIpAddr;
-		   
-				if (ipAddr && this->_serviceFoundCallback) {
-					_serviceFoundCallback(typeName, _resolveServiceProto, (const char*)ptrNames[i], 
-										  (const byte*)ipAddr, (unsigned short)ptrPorts[i], (const char*)servTxt[i]);
-				}
-            }
-        	*p = '.';
-        }
-        
-        for (uint8_t k = 0; k < MDNS_MAX_SERVICES_PER_PACKET; k++) 
-        {
-        	if (NULL != ptrNames[k]) {
-            	my_free(ptrNames[k]);
-               	if (NULL != servTxt[k])
-                 	my_free(servTxt[k]);
+                const MDNSNameIndexEntry_t* entry = &_nameIndex[k];
+
+                if (entry->hash != nameHash || !packet_name_equals(&reader, namePos, _nameForIndexEntry(entry)))
+                    continue;
+
+                const MDNSServiceRecord_t* record = _serviceRecords[entry->record];
+
+                switch (entry->kind)
+                {
+                    case MDNSNameHost:
+                        if (DNSTypeA == rType && 4 == dataLen) {
+                            IPAddress myIp = WiFi.localIP();
+                            if (rdata[0] == myIp[0] && rdata[1] == myIp[1] && rdata[2] == myIp[2] && rdata[3] == myIp[3])
+                                known->host |= MDNS_ANSWER_A;
+                        }
+                        break;
+
+                    case MDNSNameServices:
+                        if (DNSTypePTR == rType) {
+                            for (int j = 0; j < NumMDNSServiceRecords; j++)
+                                if (NULL != _serviceRecords[j] && packet_name_equals(&reader, dataPos, _serviceRecords[j]->servName))
+                                    answers_add(known, j, MDNS_ANSWER_SERVICES);
+                        }
+                        break;
+
+                    case MDNSNameServiceType:
+                        if (DNSTypePTR == rType && packet_name_equals(&reader, dataPos, record->name))
+                            answers_add(known, entry->record, MDNS_ANSWER_PTR);
+                        break;
+
+                    case MDNSNameServiceInstance:
+                        if (DNSTypeSRV == rType && dataLen > 6 && ((rdata[4] << 8) | rdata[5]) == record->port &&
+                            packet_name_equals(&reader, dataPos + 6, _bonjourName))
+                            answers_add(known, entry->record, MDNS_ANSWER_SRV);
+                        else if (DNSTypeTXT == rType &&
+                                 ((NULL == record->textContent && 1 == dataLen && 0 == rdata[0]) ||
+                                  (NULL != record->textContent && record->textLength == dataLen && 0 == memcmp(rdata, record->textContent, dataLen))))
+                            answers_add(known, entry->record, MDNS_ANSWER_TXT);
+                        break;
+                }
             }
         }
-	}
 
-#endif // (defined(HAS_SERVICE_REGISTRATION) && HAS_SERVICE_REGISTRATION) || (defined(HAS_NAME_BROWSING) && HAS_NAME_BROWSING)
+        _suppressedAnswers += _suppressKnownAnswers(answers, known);
+        _suppressedAnswers += _suppressKnownAnswers(unicastAnswers, known);
 
-    my_free(udpBuffer);
+        if (!legacy)
+            _checkUnicastAnswers(unicastAnswers, answers);
 
-errorReturn:
+        // a query with an authority section is a probe, defending our names against it
+        // is allowed to be more frequent
+        _rateLimitAnswers(answers, (aaCnt > 0) ? MDNS_PROBE_DEFENSE_INTERVAL : MDNS_MULTICAST_INTERVAL);
+    }
 
-#if defined(_USE_MALLOC_) 
-    if (NULL != dnsHeader)
-        my_free(dnsHeader);
-#endif
-   
-    IPAddress _remoteIP = remoteIP();
-    
-    // now, handle the requests
-    for (uint8_t j = 0; j < NumMDNSServiceRecords + 2; j++) 
+#if defined(HAS_NAME_BROWSING) && HAS_NAME_BROWSING
+
+    else if (0 != (flags & DNS_FLAG_QR) && DNSOpQuery == DNS_FLAGS_OPCODE(flags) && MDNS_SERVER_PORT == remotePort() &&
+        (_snooping || _anyQueries(MDNSQueryNone)))
     {
-        if (recordsAskedFor[j]) 
+        // questions in a response are of no interest
+        for (uint16_t i = 0; i < qCnt && !reader.error; i++) {
+            (void)reader_read_name_hash(&reader);
+            reader_skip(&reader, 4);
+        }
+
+        // the records are walked for the cache, then for the addresses and the goodbyes, then
+        // once more for every instance found, to join it with its other records
+        MDNSReader_t records = reader;
+        uint16_t recordCount = aCnt + aaCnt + addCnt;
+        MDNSRecordView_t rec;
+
+        _cacheRecords(&records, recordCount);
+
+        for (uint16_t i = 0; i < aCnt && reader_read_record(&reader, &rec); i++)
         {
-            if (0 == j)
-                (void)_sendMDNSMessage(&_remoteIP, xid, (int)MDNSPacketTypeMyIPAnswer, 0);
-            else if (1 == j) {
-                for (uint8_t k = 0; k < NumMDNSServiceRecords; k++)
-                    recordsAskedFor[k + 2] = 1;
-            } 
-            else if (NULL != _serviceRecords[ j- 2])
-                (void)_sendMDNSMessage(&_remoteIP, xid, (int)MDNSPacketTypeServiceRecord, j - 2);
+            if (DNSClassIN != (rec.rclass & ~DNS_CLASS_CACHE_FLUSH))
+                continue;
+
+            // every answer is matched against all of the lookups at once
+            for (int q = 0; q < MDNS_MAX_QUERIES; q++)
+            {
+                const MDNSQuery_t* query = &_queries[q];
+
+                if (MDNSQueryNone == query->kind || query->nameHash != rec.nameHash ||
+                    !packet_name_equals(&reader, rec.namePos, query->name))
+                    continue;
+
+                // a goodbye says the address is no longer valid; it never answers a lookup
+                if (MDNSQueryName == query->kind && DNSTypeA == rec.type && 4 == rec.dataLen && 0 != rec.ttl)
+                {
+                    // ok, this is the IP address. report it via callback.
+                    _reportName(q, reader.data + rec.dataPos);
+                }
+                else if (MDNSQueryService == query->kind && DNSTypePTR == rec.type && 0 == rec.ttl)
+                {
+                    char instanceName[MDNS_MAX_LABEL_LEN + 1];
+                    if (instance_label(&reader, &rec, instanceName))
+                        _lostInstance(q, instanceName);
+                }
+            }
         }
+
+        _reportInstances(&records, aCnt, recordCount);
+        _recheckInstances(&records, recordCount);
+
+        // the address of an instance looked for by name may come on its own, once its SRV
+        // record is cached
+        for (int q = 0; q < MDNS_MAX_QUERIES; q++)
+            if (MDNSQueryInstance == _queries[q].kind)
+                _answerFromCache(q);
     }
-   
-    // if we were asked for our IPv6 address, say that we don't have any
-    if (wantsIPv6Addr) {
-        (void)_sendMDNSMessage(&_remoteIP, xid, (int)MDNSPacketTypeNoIPv6AddrAvailable, 0);
+
+#endif // defined(HAS_NAME_BROWSING) && HAS_NAME_BROWSING
+
+errorReturn:
+
+    MDNSResponseTarget_t target;
+
+    memset(&target, 0, sizeof(target));
+    target.xid = xid;
+
+    // now, answer everything we were asked for at once
+    // (multicast answers with shared records are held back for a moment)
+    _scheduleResponse(answers);
+
+    if (!any_answers(unicastAnswers))
+        return statusCode;
+
+    IPAddress remoteAddress = remoteIP();
+    target.peerAddress = &remoteAddress;
+    target.peerPort = remotePort();
+    if (legacy) {
+        target.legacy = 1;
+        target.questionCount = qCnt;
+        target.questionsLength = questionsLength;
     }
+    (void)_sendMDNSResponse(unicastAnswers, &target);
+
     return statusCode;
 }
 
-void BonjourClass::run()
+// run() does everything that's due, and tells how long there's nothing for it to do.
+// incoming packets are only looked at when it's called, so it never asks for more than
+// a short while.
+unsigned long BonjourClass::run()
 {
-    unsigned long now = millis();
-   
+    MDNSError_t lastPacket = MDNSTryLater;
+
+    _updateState();
+
     // first, look for MDNS queries to handle
-    (void)_processMDNSQuery();
-   
-    // are we querying a name or service? if so, should we resend the packet or time out?
-    for (int i = 0; i < 2; i++) 
+    if (MDNSStateProbing <= _state) {
+        for (uint8_t n = 0; n < MDNS_MAX_PACKETS_PER_RUN; n++)
+            if (MDNSTryLater == (lastPacket = _processMDNSQuery()))
+                break;
+    }
+
+    // then, everything that's due. a timer that's set again while handling another
+    // one waits for the next run, so this can't go on forever.
+    unsigned long now = millis();
+    for (uint16_t n = 0; n < MDNS_TIMER_COUNT && _timerCount > 0 && (long)(now - _timers[0].deadline) >= 0; n++) {
+        uint16_t id = _timers[0].id;
+        _cancelTimer(id);
+        _fireTimer(id);
+    }
+
+    // there may be more packets waiting
+    if (MDNSTryLater != lastPacket)
+        return 0;
+
+    if (0 == _timerCount)
+        return MDNS_POLL_INTERVAL;
+
+    long left = (long)(_timers[0].deadline - millis());
+    if (left <= 0)
+        return 0;
+
+    return (left < MDNS_POLL_INTERVAL) ? left : MDNS_POLL_INTERVAL;
+}
+
+void BonjourClass::_fireTimer(uint16_t id)
+{
+    switch (id)
     {
-        if (NULL == _resolveNames[i]) continue;
-        
-        // Hint: _resolveLastSendMillis is updated in _sendMDNSMessage
-        if (now - _resolveLastSendMillis[i] > (uint32_t)((i == 0) ? MDNS_NQUERY_RESEND_TIME : MDNS_SQUERY_RESEND_TIME))
-            (void)_sendMDNSMessage(NULL, 0, (i == 0) ? MDNSPacketTypeNameQuery : MDNSPacketTypeServiceQuery, 0);
-      
-        if (_resolveTimeouts[i] > 0 && now > _resolveTimeouts[i]) 
-        {
-            if (i == 0)
-                _finishedResolvingName((char*)_resolveNames[0], NULL);
-            else if (i == 1 && _serviceFoundCallback) 
-            {
-                char* typeName = (char*)_resolveNames[1];
-                char* p = (char*)_resolveNames[1];
-                while (*p && *p != '.') p++;
-                *p = '\0';
-                    
-                _serviceFoundCallback(typeName, _resolveServiceProto, NULL, NULL, 0, NULL);
+        case MDNSTimerProbe:
+            _probe();
+            break;
+
+        case MDNSTimerResponse:
+            _sendScheduledResponse();
+            break;
+
+#if defined(HAS_NAME_BROWSING) && HAS_NAME_BROWSING
+        case MDNSTimerCache:
+            _refreshCache();
+            break;
+
+        case MDNSTimerInstances:
+            _expireInstances();
+            break;
+#endif
+
+        default:
+#if defined(HAS_NAME_BROWSING) && HAS_NAME_BROWSING
+            if (id >= MDNSTimerQueryTimeout) {
+                _queryTimedOut(id - MDNSTimerQueryTimeout);
+                break;
             }
-               
-            if (NULL != _resolveNames[i]) {
-                my_free(_resolveNames[i]);
-                _resolveNames[i] = NULL;
+            if (id >= MDNSTimerQuery) {
+                if (MDNSStateProbing <= _state)
+                    (void)_sendQueries();
+                break;
             }
-        }
+#endif
+            // (re-)announce our services
+            _sendDueAnnouncements();
+            break;
     }
-   
-    // now, should we re-announce our services again?
-    unsigned long announceTimeOut = (((uint32_t)MDNS_RESPONSE_TTL/2)+((uint32_t)MDNS_RESPONSE_TTL/4));
-    if ((now - _lastAnnounceMillis) > 1000 * announceTimeOut) 
-    {
-        for (int i = 0; i < NumMDNSServiceRecords; i++) {
-            if (NULL == _serviceRecords[i]) continue;
-            (void)_sendMDNSMessage(NULL, 0, (int)MDNSPacketTypeServiceRecord, i);
-        }
-      
-        _lastAnnounceMillis = now;
+}
+
+// the timer heap, with the earliest deadline at the top
+void BonjourClass::_swapTimers(uint16_t a, uint16_t b)
+{
+    MDNSTimer_t t = _timers[a];
+    _timers[a] = _timers[b];
+    _timers[b] = t;
+
+    _timerSlots[_timers[a].id] = a;
+    _timerSlots[_timers[b].id] = b;
+}
+
+void BonjourClass::_siftTimerUp(uint16_t pos)
+{
+    while (pos > 0 && deadline_before(_timers[pos].deadline, _timers[(pos - 1) / 2].deadline)) {
+        _swapTimers(pos, (pos - 1) / 2);
+        pos = (pos - 1) / 2;
+    }
+}
+
+void BonjourClass::_siftTimerDown(uint16_t pos)
+{
+    for (;;) {
+        uint16_t first = pos;
+        uint16_t left = 2 * pos + 1, right = 2 * pos + 2;
+
+        if (left < _timerCount && deadline_before(_timers[left].deadline, _timers[first].deadline))
+            first = left;
+        if (right < _timerCount && deadline_before(_timers[right].deadline, _timers[first].deadline))
+            first = right;
+        if (first == pos)
+            return;
+
+        _swapTimers(pos, first);
+        pos = first;
+    }
+}
+
+// sets a timer, or moves it if it's already pending
+void BonjourClass::_setTimer(uint16_t id, unsigned long deadline)
+{
+    uint16_t pos = _timerSlots[id];
+
+    if (MDNS_TIMER_NONE == pos) {
+        pos = _timerCount++;
+        _timers[pos].id = id;
+        _timerSlots[id] = pos;
+    }
+
+    _timers[pos].deadline = deadline;
+    _siftTimerUp(pos);
+    _siftTimerDown(_timerSlots[id]);
+}
+
+void BonjourClass::_cancelTimer(uint16_t id)
+{
+    uint16_t pos = _timerSlots[id];
+    if (MDNS_TIMER_NONE == pos)
+        return;
+
+    // the last timer takes its place
+    _swapTimers(pos, --_timerCount);
+    _timerSlots[id] = MDNS_TIMER_NONE;
+
+    if (pos < _timerCount) {
+        uint16_t moved = _timers[pos].id;
+        _siftTimerUp(pos);
+        _siftTimerDown(_timerSlots[moved]);
     }
 }
 
+int BonjourClass::_timerPending(uint16_t id)
+{
+    return MDNS_TIMER_NONE != _timerSlots[id];
+}
+
+unsigned long BonjourClass::_timerDeadline(uint16_t id)
+{
+    return _timers[_timerSlots[id]].deadline;
+}
+
 // return values:
 // 1 on success
 // 0 otherwise
@@ -1108,19 +3121,33 @@ int BonjourClass::setBonjourName(const char* bonjourName)
 {
     if (NULL == bonjourName || 0 == *bonjourName) 
         return 0;
-         
-    if (_bonjourName != NULL)
-        my_free(_bonjourName);
-   
-    _bonjourName = (uint8_t*)my_malloc(strlen(bonjourName) + 7);
-    if (NULL == _bonjourName)
+    
+    uint16_t nameLength;
+    uint8_t* name = alloc_wire_name(bonjourName, mdnsTldPostfix, sizeof(mdnsTldPostfix), &nameLength);
+    if (NULL == name)
         return 0;
-   
-    strcpy((char*)_bonjourName, bonjourName);
-    strcat((char*)_bonjourName, MDNS_TLD);
+    
+    _useBonjourName(name, nameLength);
     return 1;
 }
 
+void BonjourClass::_useBonjourName(uint8_t* name, uint16_t nameLength)
+{
+    if (_bonjourName != NULL)
+        my_free(_bonjourName);
+    
+    _bonjourName = name;
+    _bonjourNameLength = nameLength;
+    
+    _invalidateCachedResponses();
+    _restartAnnouncements();
+    _rebuildNameIndex();
+
+    // a new name is probed for before it's used
+    if (MDNSStateProbing <= _state)
+        _startProbing();
+}
+
 // return values:
 // 1 on success
 // 0 otherwise
@@ -1139,42 +3166,53 @@ int BonjourClass::addServiceRecord(const char* name, uint16_t port, MDNSServiceP
     int status = 0;
     MDNSServiceRecord_t* record = NULL;
     
-    for (uint8_t i = 0; i < NumMDNSServiceRecords; i++) 
+    for (int i = 0; i < NumMDNSServiceRecords; i++) 
     {
         if (NULL != _serviceRecords[i]) continue; // slot is not empty
         
         record = (MDNSServiceRecord_t*)my_malloc(sizeof(MDNSServiceRecord_t));
         if (NULL == record) break; // allocation has failed, no reason to retry
             
-        record->name = record->textContent = NULL;
-               
-        record->name = (uint8_t*)my_malloc(strlen((char*)name));
+        record->name = record->textContent = record->announcement = NULL;
+        record->textLength = record->announcementLength = 0;
+        
+        const uint8_t* postfix = wire_postfix_for_protocol(proto);
+        uint16_t postfixLen = sizeof(mdnsTcpPostfix);
+        
+        record->name = alloc_wire_name(name, postfix, postfixLen, &record->nameLength);
         if (NULL == record->name)
             goto errorReturn;
                
         if (NULL != textContent && 0 != *textContent) {
-            record->textContent = (uint8_t*)my_malloc(strlen((char*)textContent));
+            record->textLength = strlen(textContent);
+            record->textContent = (uint8_t*)my_malloc(record->textLength);
             if (NULL == record->textContent)
                 goto errorReturn;
               
-            strcpy((char*)record->textContent, textContent);
+            memcpy(record->textContent, textContent, record->textLength);
         }
            
         record->port = port;
         record->proto = proto;
-        strcpy((char*)record->name, name);
-               
-        uint8_t* s = _findFirstDotFromRight(record->name);
-        record->servName = (uint8_t*)my_malloc(strlen((char*)s) + 12);
-        if (record->servName) {
-            strcpy((char*)record->servName, (const char*)s);
-            const uint8_t* srv_type = _postfixForProtocol(proto);
-            if (srv_type)
-                strcat((char*)record->servName, (const char*)srv_type);
-        }
+        
+        for (uint8_t j = 0; j < 4; j++)
+            record->lastMulticast[j] = millis() - MDNS_MULTICAST_INTERVAL;
+        
+        // the service type is the last label of the given name followed by the protocol postfix
+        record->servName = record->name;
+        for (uint8_t* p = record->name; p < record->name + record->nameLength - postfixLen; p += *p + 1)
+            record->servName = p;
+        record->servNameLength = record->nameLength - (record->servName - record->name);
             
+        // the first announcement goes out with the next run(), together with
+        // those of the other records added by then
+        record->announceCount = 0;
+        _setTimer(MDNSTimerAnnounce + i, millis());
+        
         _serviceRecords[i] = record;
-        status = (MDNSSuccess == _sendMDNSMessage(0, 0, (int)MDNSPacketTypeServiceRecord, i));
+        _rebuildNameIndex();
+        
+        status = 1;
         break;
     }
 
@@ -1184,8 +3222,6 @@ errorReturn:
     if (NULL != record) {
         if (NULL != record->name)
             my_free(record->name);
-        if (NULL != record->servName)
-            my_free(record->servName);
         if (NULL != record->textContent)
             my_free(record->textContent);
       
@@ -1194,22 +3230,52 @@ errorReturn:
     return 0;
 }
 
+// tells everyone that the service records in the answer set are gone, in as few packets as possible
+void BonjourClass::_sendGoodbyes(const MDNSAnswerSet_t* answers)
+{
+   MDNSResponseTarget_t target;
+   
+   // nothing was announced yet
+   if (MDNSStateAnnouncing != _state)
+      return;
+   
+   memset(&target, 0, sizeof(target));
+   target.goodbye = 1;
+   (void)_sendMDNSResponse(answers, &target);
+}
+
 void BonjourClass::_removeServiceRecord(int idx)
 {
    if (NULL != _serviceRecords[idx]) 
    {
-      (void)_sendMDNSMessage(0, 0, (int)MDNSPacketTypeServiceRecordRelease, idx);
+      MDNSAnswerSet_t answers;
+      
+      memset(&answers, 0, sizeof(answers));
+      answers_add(&answers, idx, MDNS_ANSWER_PTR);
+      _sendGoodbyes(&answers);
       
+      _freeServiceRecord(idx);
+   }
+}
+
+void BonjourClass::_freeServiceRecord(int idx)
+{
+   if (NULL != _serviceRecords[idx]) 
+   {
       if (NULL != _serviceRecords[idx]->textContent)
          my_free(_serviceRecords[idx]->textContent);
-      
-      if (NULL != _serviceRecords[idx]->servName)
-         my_free(_serviceRecords[idx]->servName);
+      if (NULL != _serviceRecords[idx]->announcement)
+         my_free(_serviceRecords[idx]->announcement);
       
       my_free(_serviceRecords[idx]->name);
       my_free(_serviceRecords[idx]);
       
       _serviceRecords[idx] = NULL;
+      _scheduledAnswers.records[idx] = 0;
+      answers_compact(&_scheduledAnswers);
+      _invalidateCachedResponses();
+      _cancelTimer(MDNSTimerAnnounce + idx);
+      _rebuildNameIndex();
    }
 }
 
@@ -1220,188 +3286,299 @@ void BonjourClass::removeServiceRecord(uint16_t port, MDNSServiceProtocol_t prot
 
 void BonjourClass::removeServiceRecord(const char* name, uint16_t port, MDNSServiceProtocol_t proto)
 {
-	for (uint8_t i = 0; i < NumMDNSServiceRecords; i++)
-		if (port == _serviceRecords[i]->port && proto == _serviceRecords[i]->proto &&
-			(NULL == name || 0 == strcmp((char*)_serviceRecords[i]->name, name))) {
+	uint8_t wireName[MDNS_MAX_NAME_LEN];
+	uint16_t wireLen = 0;
+	
+	// compare everything but the protocol postfix
+	if (NULL != name && 0 == (wireLen = encode_wire_name(name, NULL, 0, wireName, sizeof(wireName))))
+		return;
+	
+	for (int i = 0; i < NumMDNSServiceRecords; i++)
+		if (NULL != _serviceRecords[i] && port == _serviceRecords[i]->port && proto == _serviceRecords[i]->proto &&
+			(NULL == name || (wireLen == _serviceRecords[i]->nameLength - sizeof(mdnsTcpPostfix) &&
+			                  0 == memcmp(_serviceRecords[i]->name, wireName, wireLen)))) {
 			_removeServiceRecord(i);
 			break;
 		}
 }
 
+unsigned long BonjourClass::suppressedAnswerCount()
+{
+	return _suppressedAnswers;
+}
+
 void BonjourClass::removeAllServiceRecords()
 {
-	for (uint8_t i = 0; i < NumMDNSServiceRecords; i++)
-		_removeServiceRecord(i);
+	MDNSAnswerSet_t answers;
+	
+	memset(&answers, 0, sizeof(answers));
+	for (int i = 0; i < NumMDNSServiceRecords; i++)
+		if (NULL != _serviceRecords[i])
+			answers_add(&answers, i, MDNS_ANSWER_PTR);
+	
+	_sendGoodbyes(&answers);
+	
+	for (int i = 0; i < NumMDNSServiceRecords; i++)
+		_freeServiceRecord(i);
 }
 
-void BonjourClass::_writeDNSName(const uint8_t* name, uint16_t* pPtr, uint8_t* buf, int bufSize, int zeroTerminate)
+// says goodbye for all our services, drops all pending queries, stops snooping, and closes the socket
+void BonjourClass::end()
 {
-	uint16_t ptr = *pPtr;
-	uint8_t* p1 = (uint8_t*)name, *p2, *p3;
-	int i, c, len;
-   
-	while(*p1) {
-		c = 1;
-		p2 = p1;
-		while (0 != *p2 && '.' != *p2) { p2++; c++; };
-
-		p3 = buf;
-		i = c;
-		len = bufSize - 1;
-      	*p3++ = (uint8_t)--i;
-		while (i-- > 0) {
-			*p3++ = *p1++;
-
-			if (--len <= 0) {
-            	write((uint8_t*)buf, bufSize);
-            	ptr += bufSize;
-            	len = bufSize;
-            	p3 = buf;
-         	}
-      	}
-
-		while ('.' == *p1)
-			p1++;
-
-		if (len != bufSize) {
-			write((uint8_t*)buf, bufSize-len);
-			ptr += bufSize-len;
-		}
-   	}
-   
-   	if (zeroTerminate) {
-      	buf[0] = 0;
-      	write((uint8_t*)buf, 1);
-      	ptr += 1;
-   	}
-     
-   	*pPtr = ptr;
+	removeAllServiceRecords();
+	
+#if defined(HAS_NAME_BROWSING) && HAS_NAME_BROWSING
+	for (int i = 0; i < MDNS_MAX_QUERIES; i++)
+		_cancelQuery(i);
+	stopSnooping();
+#endif
+	
+	stop();
+	_state = MDNSStateIdle;
 }
 
-void BonjourClass::_writeMyIPAnswerRecord(uint16_t* pPtr, uint8_t* buf, int bufSize)
+// the outgoing packet builder. everything is written straight into the write buffer;
+// a write that doesn't fit raises the overflow flag and is dropped along with all
+// writes that follow, so the packet can be truncated back to a good offset.
+void BonjourClass::_writeBytes(const uint8_t* data, uint16_t len)
 {
-	uint16_t ptr = *pPtr;
-   
-	_writeDNSName(_bonjourName, &ptr, buf, bufSize, 1);
+	if (_writeOverflow || len > sizeof(_writeBuffer) - _writeOffset) {
+		_writeOverflow = 1;
+		return;
+	}
+	
+	memcpy(_writeBuffer + _writeOffset, data, len);
+	_writeOffset += len;
+}
 
-	buf[0] = 0x00;
-	buf[1] = 0x01;
-	buf[2] = 0x80; // cache flush: true
-	buf[3] = 0x01;
-	write((uint8_t*)buf, 4);
-	ptr += 4;
+void BonjourClass::_writeU16(uint16_t value)
+{
+	uint8_t bytes[2] = { (uint8_t)(value >> 8), (uint8_t)value };
+	_writeBytes(bytes, 2);
+}
 
-	*((uint32_t*)buf) = htonl(MDNS_RESPONSE_TTL);
-	*((uint16_t*)&buf[4]) = htons(4);      // data length
+void BonjourClass::_writeU32(uint32_t value)
+{
+	uint8_t bytes[4] = { (uint8_t)(value >> 24), (uint8_t)(value >> 16), (uint8_t)(value >> 8), (uint8_t)value };
+	_writeBytes(bytes, 4);
+}
 
-	IPAddress myIp = WiFi.localIP();
-	buf[6] = myIp[0];                      // our IP address
-	buf[7] = myIp[1];
-   	buf[8] = myIp[2];
-   	buf[9] = myIp[3];
+// writes a wire format name. the longest suffix of it that's already in the packet
+// is replaced by a compression pointer (RFC 1035 4.1.4), and the suffixes that are
+// new are remembered as pointer targets for the names that follow.
+void BonjourClass::_writeName(const uint8_t* name)
+{
+	MDNSReader_t packet;
+	reader_init(&packet, _writeBuffer, _writeOffset);
+	
+	size_t start = _writeOffset;
+	const uint8_t* suffix = name;
+	int target = -1;
+	
+	for (; 0 != *suffix; suffix += *suffix + 1) {
+		uint32_t hash = wire_name_hash(suffix);
+		
+		for (int i = 0; i < _packetNameCount; i++)
+			if (_packetNames[i].hash == hash && packet_name_equals(&packet, _packetNames[i].offset, suffix)) {
+				target = _packetNames[i].offset;
+				break;
+			}
+		
+		if (target >= 0)
+			break;
+	}
+	
+	if (target >= 0) {
+		_writeBytes(name, suffix - name);
+		_writeU16(0xc000 | target);
+	} else
+		_writeBytes(name, suffix - name + 1);
+	
+	if (_writeOverflow)
+		return;
+	
+	for (const uint8_t* p = name; p < suffix && _packetNameCount < MDNS_MAX_PACKET_NAMES; p += *p + 1) {
+		size_t offset = start + (p - name);
+		if (offset > 0x3fff)
+			break;
+		
+		_packetNames[_packetNameCount].hash = wire_name_hash(p);
+		_packetNames[_packetNameCount].offset = offset;
+		_packetNameCount++;
+	}
+}
 
-	write((uint8_t*)buf, 10);
-	ptr += 10;
-   
-	*pPtr = ptr;
+void BonjourClass::_writeHeader(uint16_t xid, uint16_t flags)
+{
+	_writeU16(xid);
+	_writeU16(flags);
+	_writeU32(0);     // counts, see _writeCounts()
+	_writeU32(0);
 }
 
-void BonjourClass::_writeServiceRecordName(int recordIndex, uint16_t* pPtr, uint8_t* buf, int bufSize, int tld)
+void BonjourClass::_writeCounts(uint16_t questions, uint16_t answers, uint16_t authorities, uint16_t additionals)
 {
-	uint16_t ptr = *pPtr;
-      
-	uint8_t* name = tld ? _serviceRecords[recordIndex]->servName : _serviceRecords[recordIndex]->name;
-   
-	_writeDNSName(name, &ptr, buf, bufSize, tld);
-   
-	if (0 == tld) {
-		const uint8_t* srv_type = _postfixForProtocol(_serviceRecords[recordIndex]->proto);
-   
-		if (NULL != srv_type) {
-			srv_type++; // eat the dot at the beginning
-			_writeDNSName(srv_type, &ptr, buf, bufSize, 1);
-		}
+	if (_writeOffset < DNS_HEADER_SIZE)
+		return;
+	
+	uint16_t counts[4] = { questions, answers, authorities, additionals };
+	for (uint8_t i = 0; i < 4; i++) {
+		_writeBuffer[4 + 2*i] = counts[i] >> 8;
+		_writeBuffer[5 + 2*i] = counts[i] & 0xff;
 	}
-   
-	*pPtr = ptr;
 }
 
-void BonjourClass::_writeServiceRecordPTR(int recordIndex, uint16_t* pPtr, uint8_t* buf, int bufSize, uint32_t ttl)
+void BonjourClass::_addHeaderFlags(uint16_t flags)
 {
-	uint16_t ptr = *pPtr;
+	if (_writeOffset < DNS_HEADER_SIZE)
+		return;
+	
+	_writeBuffer[2] |= flags >> 8;
+	_writeBuffer[3] |= flags & 0xff;
+}
 
-	_writeServiceRecordName(recordIndex, &ptr, buf, bufSize, 1);
-   
-	buf[0] = 0x00;
-	buf[1] = 0x0c;    // PTR record
-	buf[2] = 0x00;    // no cache flush
-	buf[3] = 0x01;    // class IN
-   
-	// ttl
-	*((uint32_t*)&buf[4]) = htonl(ttl);
-   
-	// data length (+13 = "._tcp.local" or "._udp.local" + 1  byte zero termination)
-	*((uint16_t*)&buf[8]) = htons(strlen((char*)_serviceRecords[recordIndex]->name) + 13);
+void BonjourClass::_writeQuestion(const uint8_t* name, uint16_t type, uint16_t qclass)
+{
+	_writeName(name);
+	_writeU16(type);
+	_writeU16(qclass);
+}
 
-	write((uint8_t*)buf, 10);
-	ptr += 10;
-   
-	_writeServiceRecordName(recordIndex, &ptr, buf, bufSize, 0);
+// writes everything of a record up to its data.
+// return value: the offset of the data length, to be passed to _fixDataLength()
+size_t BonjourClass::_writeRecordHeader(const uint8_t* name, uint16_t type, uint8_t cacheFlush, uint32_t ttl)
+{
+	_writeName(name);
+	_writeU16(type);
+	_writeU16(cacheFlush ? (DNSClassIN | DNS_CLASS_CACHE_FLUSH) : DNSClassIN);
+	_writeU32(ttl);
 	
-	*pPtr = ptr;
+	size_t lengthOffset = _writeOffset;
+	_writeU16(0);
+	return lengthOffset;
 }
 
-uint8_t* BonjourClass::_findFirstDotFromRight(const uint8_t* str)
+void BonjourClass::_writeA(const uint8_t* name, uint32_t ttl, uint8_t cacheFlush)
 {
-	const uint8_t* p = str + strlen((char*)str);
-	while (p > str && '.' != *p--);
-	return (uint8_t*)&p[2];
+	IPAddress myIp = WiFi.localIP();
+	uint8_t addr[4] = { myIp[0], myIp[1], myIp[2], myIp[3] };
+	
+	size_t lengthOffset = _writeRecordHeader(name, DNSTypeA, cacheFlush, ttl);
+	_writeBytes(addr, 4);
+	_fixDataLength(lengthOffset);
 }
 
-int BonjourClass::_matchStringPart(const uint8_t** pCmpStr, int* pCmpLen, const uint8_t* buf, int dataLen)
+void BonjourClass::_writePTR(const uint8_t* name, const uint8_t* target, uint32_t ttl)
 {
-	int matches = 1;
+	size_t lengthOffset = _writeRecordHeader(name, DNSTypePTR, 0, ttl);
+	_writeName(target);
+	_fixDataLength(lengthOffset);
+}
 
-	if (*pCmpLen >= dataLen)
-		matches &= (0 == memcmp(*pCmpStr, buf, dataLen));
-	else
-		matches = 0;
+void BonjourClass::_writeSRV(const uint8_t* name, uint16_t port, const uint8_t* target, uint32_t ttl, uint8_t cacheFlush)
+{
+	size_t lengthOffset = _writeRecordHeader(name, DNSTypeSRV, cacheFlush, ttl);
+	_writeU16(0);     // priority
+	_writeU16(0);     // weight
+	_writeU16(port);
+	_writeName(target);
+	_fixDataLength(lengthOffset);
+}
 
-	*pCmpStr += dataLen;
-	*pCmpLen -= dataLen;
-	if ('.' == **pCmpStr)
-		(*pCmpStr)++, (*pCmpLen)--;
+void BonjourClass::_writeTXT(const uint8_t* name, const uint8_t* text, uint16_t len, uint32_t ttl, uint8_t cacheFlush)
+{
+	static const uint8_t emptyText[1] = { 0 };
+	
+	// a TXT record can't be empty, it holds a single empty string instead
+	if (NULL == text || 0 == len) {
+		text = emptyText;
+		len = sizeof(emptyText);
+	}
+	
+	size_t lengthOffset = _writeRecordHeader(name, DNSTypeTXT, cacheFlush, ttl);
+	_writeBytes(text, len);
+	_fixDataLength(lengthOffset);
+}
 
-	return matches;
+// says that the name has an A record, and nothing else (RFC 6762 6.1)
+void BonjourClass::_writeNSEC(const uint8_t* name, uint32_t ttl, uint8_t cacheFlush)
+{
+	static const uint8_t typeBitmap[3] = { 0x00, 0x01, 0x40 };   // window 0, 1 byte, type 1
+	
+	size_t lengthOffset = _writeRecordHeader(name, DNSTypeNSEC, cacheFlush, ttl);
+	_writeName(name);
+	_writeBytes(typeBitmap, sizeof(typeBitmap));
+	_fixDataLength(lengthOffset);
 }
 
-const uint8_t* BonjourClass::_postfixForProtocol(MDNSServiceProtocol_t proto)
+#if defined(HAS_NAME_BROWSING) && HAS_NAME_BROWSING
+
+// a record from the cache, as a known answer
+void BonjourClass::_writeCachedRecord(const MDNSCacheEntry_t* entry, uint32_t ttl)
 {
-	const uint8_t* srv_type = NULL;
-	switch(proto) {
-		case MDNSServiceTCP:
-			srv_type = (uint8_t*)"._tcp" MDNS_TLD;
+	size_t lengthOffset = _writeRecordHeader(entry->name, entry->type, 0, ttl);
+	
+	switch (entry->type) {
+		case DNSTypePTR:
+			_writeName(entry->data);
+			break;
+		case DNSTypeSRV:
+			_writeBytes(entry->data, 6);
+			_writeName(entry->data + 6);
 			break;
-		case MDNSServiceUDP:
-			srv_type = (uint8_t*)"._udp" MDNS_TLD;
+		default:
+			_writeBytes(entry->data, entry->dataLength);
 			break;
 	}
-	return srv_type;
+	
+	_fixDataLength(lengthOffset);
 }
 
-void BonjourClass::_finishedResolvingName(char* name, const byte ipAddr[4])
-{   
-	if (NULL != _nameFoundCallback) {
-		if (NULL != name) {
-			uint8_t* n = _findFirstDotFromRight((const uint8_t*)name);
-			*(n-1) = '\0';
-		}
-   
-		_nameFoundCallback((const char*)name, ipAddr);
+#endif // defined(HAS_NAME_BROWSING) && HAS_NAME_BROWSING
+
+void BonjourClass::_indexName(MDNSNameKind_t kind, uint16_t record, const uint8_t* name)
+{
+	uint32_t hash = wire_name_hash(name);
+	
+	int k = hash % MDNS_NAME_INDEX_SIZE;
+	while (MDNSNameNone != _nameIndex[k].kind)
+		k = (k + 1) % MDNS_NAME_INDEX_SIZE;
+	
+	_nameIndex[k].hash = hash;
+	_nameIndex[k].kind = kind;
+	_nameIndex[k].record = record;
+}
+
+// the index is small and only changes when names or records do,
+// so it's simply rebuilt from scratch
+void BonjourClass::_rebuildNameIndex()
+{
+	memset(_nameIndex, 0, sizeof(_nameIndex));
+	
+	if (NULL != _bonjourName)
+		_indexName(MDNSNameHost, 0, _bonjourName);
+	
+	_indexName(MDNSNameServices, 0, mdnsServicesName);
+	
+	for (int i = 0; i < NumMDNSServiceRecords; i++) {
+		if (NULL == _serviceRecords[i]) continue;
+		_indexName(MDNSNameServiceType, i, _serviceRecords[i]->servName);
+		_indexName(MDNSNameServiceInstance, i, _serviceRecords[i]->name);
 	}
+}
 
-	my_free(_resolveNames[0]);
-	_resolveNames[0] = NULL;
+const uint8_t* BonjourClass::_nameForIndexEntry(const MDNSNameIndexEntry_t* entry)
+{
+	switch (entry->kind) {
+		case MDNSNameHost:
+			return _bonjourName;
+		case MDNSNameServiceType:
+			return _serviceRecords[entry->record]->servName;
+		case MDNSNameServiceInstance:
+			return _serviceRecords[entry->record]->name;
+		default:
+			return mdnsServicesName;
+	}
 }
 
 BonjourClass Bonjour;
\ No newline at end of file
@@ -31,9 +31,20 @@
 #ifndef _SPARK_BONJOUR_H_
 #define _SPARK_BONJOUR_H_
 
+// without name browsing, there's only the responder: no lookups, no snooping, and none of
+// the lookup, cache and instance tables (see their sizes below), nor the code for them
+#ifndef HAS_NAME_BROWSING
+#define  HAS_NAME_BROWSING       1
+#endif
+
+// begin() returns right away; the responder then works its way up from run(), and
+// falls back to waiting for the link whenever the network goes away
 typedef enum _MDNSState_t {
-    MDNSStateIdle,
-    MDNSStateQuerySent
+    MDNSStateIdle,              // not started, or shut down with end()
+    MDNSStateWaitingForLink,    // no network (yet)
+    MDNSStateBinding,           // network is up, the socket is to be opened
+    MDNSStateProbing,           // making sure nobody else uses our host name
+    MDNSStateAnnouncing         // up, answering queries and announcing our services
 } MDNSState_t;
 
 typedef enum _MDNSError_t {
@@ -61,57 +72,356 @@ typedef enum _MDNSServiceProtocol_t {
 
 typedef MDNSServiceProtocol_t MDNSServiceProtocol;
 
+// names are kept in DNS wire format (length-prefixed labels, zero-terminated),
+// so they can be matched against and copied into packets as they are
 typedef struct _MDNSServiceRecord_t {
     uint16_t                port;
     MDNSServiceProtocol_t   proto;
-    uint8_t*                name;
-    uint8_t*                servName;
+    uint8_t*                name;           // full instance name, e.g. myspark._http._tcp.local
+    uint8_t*                servName;       // service type, points into name
+    uint16_t                nameLength;
+    uint16_t                servNameLength;
     uint8_t*                textContent;
+    uint16_t                textLength;
+    unsigned long           lastMulticast[4];   // PTR, SRV, TXT, DNS-SD PTR
+    uint8_t*                announcement;       // complete announcement packet, built on demand
+    uint16_t                announcementLength;
+    uint8_t                 announceCount;      // startup announcements sent so far
 } MDNSServiceRecord_t;
 
+// what happened to an instance of a service type being looked for. an instance is added
+// once its address and port are known, updated whenever they or its TXT record change,
+// and removed when it says goodbye or its PTR record expires.
+typedef enum _MDNSServiceEvent_t {
+    MDNSServiceAdded,
+    MDNSServiceUpdated,
+    MDNSServiceRemoved
+} MDNSServiceEvent_t;
+
+// a service lookup that timed out is reported without an instance name. these callbacks only
+// hear of instances found; removals go to lookups with a callback of their own.
 typedef void (*BonjourNameFoundCallback)(const char*, const byte[4]);
 typedef void (*BonjourServiceFoundCallback)(const char*, MDNSServiceProtocol_t, const char*,
                                             const byte[4], unsigned short, const char*);
 
+// same as above, for lookups with a callback of their own; the context is the one given
+// when the lookup was started. instances that are removed are reported without an address.
+typedef void (*BonjourNameLookupCallback)(const char*, const byte[4], void*);
+typedef void (*BonjourServiceLookupCallback)(const char*, MDNSServiceProtocol_t, MDNSServiceEvent_t, const char*,
+                                             const byte[4], unsigned short, const char*, void*);
+
+// lookups run concurrently, up to this many at a time
+#ifndef MDNS_MAX_QUERIES
+#define  MDNS_MAX_QUERIES        (8)
+#endif
+
+typedef enum _MDNSQueryKind_t {
+    MDNSQueryNone,
+    MDNSQueryName,              // A record of a host
+    MDNSQueryService,           // PTR records of a service type
+    MDNSQueryInstance           // SRV and TXT records of a service instance, and the A record of its host
+} MDNSQueryKind_t;
+
+// an outstanding lookup. lookups without a callback of their own report to the one
+// set for all of them.
+typedef struct _MDNSQuery_t {
+    uint8_t                 kind;
+    MDNSServiceProtocol_t   proto;
+    uint8_t*                name;           // wire format
+    uint32_t                nameHash;
+    BonjourNameLookupCallback       nameCallback;
+    BonjourServiceLookupCallback    serviceCallback;
+    void*                   context;
+    unsigned long           interval;       // until the question is asked again
+} MDNSQuery_t;
+
+#ifndef NumMDNSServiceRecords
 #define  NumMDNSServiceRecords   (8)
+#endif
+
+// questions are looked up by a hash of their name; the index holds the host name,
+// the DNS-SD meta service and both names of every service record, and is kept
+// at most half full
+#define  MDNS_NAME_INDEX_SIZE    (4 * (NumMDNSServiceRecords + 1))
+
+typedef enum _MDNSNameKind_t {
+    MDNSNameNone,
+    MDNSNameHost,
+    MDNSNameServices,
+    MDNSNameServiceType,
+    MDNSNameServiceInstance
+} MDNSNameKind_t;
+
+typedef struct _MDNSNameIndexEntry_t {
+    uint32_t                hash;
+    uint8_t                 kind;
+    uint16_t                record;
+} MDNSNameIndexEntry_t;
+
+// names written to the outgoing packet so far, as targets for compression pointers
+#define  MDNS_MAX_PACKET_NAMES   (32)
+
+typedef struct _MDNSPacketName_t {
+    uint32_t                hash;
+    uint16_t                offset;
+} MDNSPacketName_t;
+
+// the largest packet we send. responses that don't fit are spread over several packets.
+// 512 bytes are safe anywhere; on networks with an Ethernet-sized MTU, up to 1400 bytes
+// save packets
+#ifndef MDNS_WRITE_BUFFER_SIZE
+#define  MDNS_WRITE_BUFFER_SIZE  (512)
+#endif
+
+// incoming packets are parsed in place; anything beyond this is dropped. the default holds
+// the largest UDP payload on an Ethernet-sized MTU (1500 bytes, less the IPv4 and UDP
+// headers), which is what other responders fill their packets up to; it's at least as
+// large as the packets we send.
+#ifndef MDNS_READ_BUFFER_SIZE
+#define  MDNS_READ_BUFFER_SIZE   ((MDNS_WRITE_BUFFER_SIZE > 1472) ? MDNS_WRITE_BUFFER_SIZE : 1472)
+#endif
+
+static_assert(MDNS_READ_BUFFER_SIZE >= MDNS_WRITE_BUFFER_SIZE, "MDNS_READ_BUFFER_SIZE is smaller than MDNS_WRITE_BUFFER_SIZE");
+
+// records received for our lookups are kept for as long as their TTL says, so lookups
+// can be answered without asking again. names and data that don't fit aren't cached.
+// when the cache is full, the record used least recently makes room.
+#ifndef MDNS_CACHE_SIZE
+#define  MDNS_CACHE_SIZE         (8)
+#endif
+#define  MDNS_CACHE_NAME_SIZE    (64)
+#define  MDNS_CACHE_DATA_SIZE    (96)
+
+typedef struct _MDNSCacheEntry_t {
+    uint16_t                type;           // 0 if the entry is unused
+    uint8_t                 stale;          // flushed or said goodbye to, about to expire
+    uint16_t                dataLength;
+    uint32_t                nameHash;
+    uint32_t                ttl;            // as received, in seconds
+    unsigned long           received;
+    unsigned long           lastUsed;       // received, or used to answer a lookup
+    unsigned long           expires;
+    unsigned long           refreshAt;      // when it's asked for again, unless it's received by then
+    uint8_t                 refreshes;      // questions asked for it since it was received
+    uint8_t                 name[MDNS_CACHE_NAME_SIZE];     // wire format
+    uint8_t                 data[MDNS_CACHE_DATA_SIZE + 1]; // names in it uncompressed, TXT data zero-terminated
+} MDNSCacheEntry_t;
+
+// while snooping, records other hosts announce are cached as well: those of instances of
+// up to this many service types, or all of them if no type is given
+#ifndef MDNS_MAX_SNOOP_TYPES
+#define  MDNS_MAX_SNOOP_TYPES    (4)
+#endif
+
+// instances reported to the service lookups, so that they are only reported again when
+// something about them changes
+#ifndef MDNS_MAX_INSTANCES
+#define  MDNS_MAX_INSTANCES      (8)
+#endif
+#define  MDNS_INSTANCE_NAME_SIZE (64)
+
+typedef struct _MDNSInstance_t {
+    uint8_t                 used;
+    uint8_t                 query;          // index of the lookup
+    uint32_t                fingerprint;    // of the address, port and TXT record reported last
+    unsigned long           expires;        // along with its PTR record
+    char                    name[MDNS_INSTANCE_NAME_SIZE];  // first label of the instance name
+} MDNSInstance_t;
+
+// everything run() has to do at some point in time has a timer. pending timers are kept
+// in a min-heap by deadline, so run() only looks at the earliest one.
+typedef enum _MDNSTimerId_t {
+    MDNSTimerProbe,
+    MDNSTimerResponse,              // multicast response held back for a moment
+    MDNSTimerCache,                 // next cache entry to expire or to be asked for again
+    MDNSTimerInstances,             // next reported instance to expire
+    MDNSTimerAnnounce,              // one per service record,
+    MDNSTimerQuery = MDNSTimerAnnounce + NumMDNSServiceRecords,     // one per lookup for its next question,
+    MDNSTimerQueryTimeout = MDNSTimerQuery + MDNS_MAX_QUERIES       // and one for its timeout
+} MDNSTimerId_t;
+
+#define  MDNS_TIMER_COUNT        (MDNSTimerQueryTimeout + MDNS_MAX_QUERIES)
+#define  MDNS_TIMER_NONE         (0xffff)   // heap position of a timer that isn't pending
+
+static_assert(MDNS_TIMER_COUNT < MDNS_TIMER_NONE, "too many timers, lower NumMDNSServiceRecords or MDNS_MAX_QUERIES");
+
+typedef struct _MDNSTimer_t {
+    unsigned long           deadline;
+    uint16_t                id;
+} MDNSTimer_t;
+
+// records owed in a response to one incoming packet, as flags per owned record.
+// the records with flags are listed as well, so going through a set takes as long
+// as the records in it, not as long as there's room for
+typedef struct _MDNSAnswerSet_t {
+    uint8_t                 host;
+    uint16_t                count;
+    uint8_t                 records[NumMDNSServiceRecords];
+    uint16_t                listed[NumMDNSServiceRecords];  // the first count of them
+} MDNSAnswerSet_t;
+
+// where a response goes: multicast if there's no peer address, unicast otherwise.
+// legacy unicast responses (RFC 6762 6.7) go to queriers not using port 5353; they
+// repeat the questions of the query, which are still in the receive buffer.
+typedef struct _MDNSResponseTarget_t {
+    uint32_t                xid;
+    IPAddress*              peerAddress;
+    uint16_t                peerPort;
+    uint8_t                 legacy;
+    uint8_t                 goodbye;
+    uint16_t                questionCount;
+    uint16_t                questionsLength;
+} MDNSResponseTarget_t;
+
+// read cursor over a received packet, and an instance joined from its records, see Bonjour.cpp
+typedef struct _MDNSReader_t MDNSReader_t;
+typedef struct _MDNSJoinedInstance_t MDNSJoinedInstance_t;
 
 class BonjourClass : public UDP
 {
 private:
     size_t               _writeOffset;
-    uint8_t              _writeBuffer[512];
+    uint8_t              _writeOverflow;
+    uint8_t              _writeBuffer[MDNS_WRITE_BUFFER_SIZE];
+    MDNSPacketName_t     _packetNames[MDNS_MAX_PACKET_NAMES];
+    uint8_t              _packetNameCount;
+    uint8_t              _readBuffer[MDNS_READ_BUFFER_SIZE + 1];    // a spare byte to terminate TXT records in place
+    IPAddress            _packetAddress;    // where the packet being written goes, and its header,
+    uint16_t             _packetPort;       // for the packets that continue it
+    uint16_t             _packetXid;
+    uint16_t             _packetFlags;
+    uint16_t             _packetCounts[4];  // questions, answers, authorities, additionals
     
     MDNSDataInternal_t   _mdnsData;
     MDNSState_t          _state;
     uint8_t*             _bonjourName;
+    uint16_t             _bonjourNameLength;
     MDNSServiceRecord_t* _serviceRecords[NumMDNSServiceRecords];
-    unsigned long        _lastAnnounceMillis;
+    MDNSNameIndexEntry_t _nameIndex[MDNS_NAME_INDEX_SIZE];
+    unsigned long        _suppressedAnswers;
+    unsigned long        _hostLastMulticast[2];     // A, NSEC
+    uint8_t              _announcedIP[4];
+    uint8_t              _linkIP[4];                // our address when the socket was opened
+    uint8_t              _probeCount;
+    MDNSAnswerSet_t      _scheduledAnswers;
+    MDNSAnswerSet_t      _queryAnswers;             // for the query at hand, kept empty in between:
+    MDNSAnswerSet_t      _queryUnicastAnswers;      // owed by multicast and by unicast,
+    MDNSAnswerSet_t      _queryKnownAnswers;        // and those the querier knows
+    uint8_t*             _cachedResponse;           // the last response that wasn't an announcement,
+    uint16_t             _cachedResponseLength;
+    MDNSAnswerSet_t      _cachedResponseAnswers;    // and the records it holds
     
-    uint8_t*             _resolveNames[2];
-    unsigned long        _resolveLastSendMillis[2];
-    unsigned long        _resolveTimeouts[2];
+    MDNSTimer_t          _timers[MDNS_TIMER_COUNT];     // heap, earliest deadline first
+    uint16_t             _timerCount;
+    uint16_t             _timerSlots[MDNS_TIMER_COUNT]; // heap position by timer id
     
-    MDNSServiceProtocol_t _resolveServiceProto;
+#if defined(HAS_NAME_BROWSING) && HAS_NAME_BROWSING
+    MDNSQuery_t          _queries[MDNS_MAX_QUERIES];
+    MDNSCacheEntry_t     _cache[MDNS_CACHE_SIZE];
+    MDNSInstance_t       _instances[MDNS_MAX_INSTANCES];
+    uint8_t              _snooping;
+    uint8_t*             _snoopTypes[MDNS_MAX_SNOOP_TYPES];     // wire format
     
     BonjourNameFoundCallback      _nameFoundCallback;
     BonjourServiceFoundCallback   _serviceFoundCallback;
+#endif
     
     MDNSError_t _processMDNSQuery();
-    MDNSError_t _sendMDNSMessage(IPAddress *peerAddress, uint32_t xid, int type, int serviceRecord);
+    MDNSError_t _sendMDNSResponse(const MDNSAnswerSet_t* answers, const MDNSResponseTarget_t* target);
+    
+    void _addServiceTypeAnswers(MDNSAnswerSet_t* answers);
+    int _suppressKnownAnswers(MDNSAnswerSet_t* answers, const MDNSAnswerSet_t* known);
+    unsigned long* _lastMulticastFor(int recordIndex, uint8_t what);
+    void _rateLimitAnswers(MDNSAnswerSet_t* answers, unsigned long interval);
+    void _checkUnicastAnswers(MDNSAnswerSet_t* unicastAnswers, MDNSAnswerSet_t* answers);
+    void _scheduleResponse(const MDNSAnswerSet_t* answers);
+    void _sendScheduledResponse();
+    void _beginResponse(const MDNSResponseTarget_t* target);
+    void _writeOwnedRecord(int recordIndex, uint8_t what, const MDNSResponseTarget_t* target);
+    void _truncatePacket(size_t offset);
+    void _startPacket(IPAddress ip, uint16_t port, uint16_t xid, uint16_t flags);
+    void _finishPacket(uint16_t flags);
+    MDNSError_t _fitEntry(size_t mark, uint8_t section, uint8_t split, uint16_t flags);
     
-    void _writeDNSName(const uint8_t* name, uint16_t* pPtr, uint8_t* buf, int bufSize, int zeroTerminate);
-    void _writeMyIPAnswerRecord(uint16_t* pPtr, uint8_t* buf, int bufSize);
-    void _writeServiceRecordName(int recordIndex, uint16_t* pPtr, uint8_t* buf, int bufSize, int tld);
-    void _writeServiceRecordPTR(int recordIndex, uint16_t* pPtr, uint8_t* buf, int bufSize, uint32_t ttl);
+    const uint8_t* _announcementFor(int recordIndex, uint16_t* pLen);
+    void _keepResponse(const MDNSAnswerSet_t* answers, uint16_t length);
+    void _invalidateCachedResponses();
+    MDNSError_t _sendCachedResponse(const MDNSAnswerSet_t* answers, const MDNSResponseTarget_t* target);
+    void _sendDueAnnouncements();
+    void _restartAnnouncements();
     
-    int _initQuery(uint8_t idx, const char* name, unsigned long timeout);
-    void _cancelQuery(uint8_t idx);
+    void _setTimer(uint16_t id, unsigned long deadline);
+    void _cancelTimer(uint16_t id);
+    int _timerPending(uint16_t id);
+    unsigned long _timerDeadline(uint16_t id);
+    void _swapTimers(uint16_t a, uint16_t b);
+    void _siftTimerUp(uint16_t pos);
+    void _siftTimerDown(uint16_t pos);
+    void _fireTimer(uint16_t id);
+    
+    void _updateState();
+    void _startProbing();
+    void _probe();
+    void _sendProbe();
+    void _renameAfterConflict();
+    void _useBonjourName(uint8_t* name, uint16_t nameLength);
+    void _fixDataLength(size_t lengthOffset);
+    
+    void _writeBytes(const uint8_t* data, uint16_t len);
+    void _writeU16(uint16_t value);
+    void _writeU32(uint32_t value);
+    void _writeName(const uint8_t* name);
+    void _writeHeader(uint16_t xid, uint16_t flags);
+    void _writeCounts(uint16_t questions, uint16_t answers, uint16_t authorities, uint16_t additionals);
+    void _addHeaderFlags(uint16_t flags);
+    void _writeQuestion(const uint8_t* name, uint16_t type, uint16_t qclass);
+    size_t _writeRecordHeader(const uint8_t* name, uint16_t type, uint8_t cacheFlush, uint32_t ttl);
+    void _writeA(const uint8_t* name, uint32_t ttl, uint8_t cacheFlush);
+    void _writePTR(const uint8_t* name, const uint8_t* target, uint32_t ttl);
+    void _writeSRV(const uint8_t* name, uint16_t port, const uint8_t* target, uint32_t ttl, uint8_t cacheFlush);
+    void _writeTXT(const uint8_t* name, const uint8_t* text, uint16_t len, uint32_t ttl, uint8_t cacheFlush);
+    void _writeNSEC(const uint8_t* name, uint32_t ttl, uint8_t cacheFlush);
+    
+#if defined(HAS_NAME_BROWSING) && HAS_NAME_BROWSING
+    MDNSError_t _sendQueries();
+    int _addQuery(MDNSQueryKind_t kind, const char* name, MDNSServiceProtocol_t proto, unsigned long timeout, void* context);
+    void _cancelQuery(int idx);
+    void _cancelQueries(MDNSQueryKind_t kind, const uint8_t* name, uint8_t ownCallback);
+    int _anyQueries(MDNSQueryKind_t kind);
+    void _queryTimedOut(int idx);
+    void _reportName(int idx, const byte ipAddr[4]);
+    int _queryQuestions(int idx, uint16_t types[], const uint8_t* names[]);
+    void _reportService(const MDNSQuery_t* query, MDNSServiceEvent_t event, const char* instanceName, const byte ipAddr[4], unsigned short port, const char* txtContent);
+    void _finishService(int idx, MDNSServiceEvent_t event, const char* instanceName, const byte ipAddr[4], unsigned short port, const char* txtContent);
+    
+    MDNSInstance_t* _findInstance(int idx, const char* name);
+    void _foundInstance(int idx, const char* name, const byte ipAddr[4], unsigned short port, const char* txtContent, uint32_t ttl);
+    void _lostInstance(int idx, const char* name);
+    void _expireInstances();
+    
+    void _writeCachedRecord(const MDNSCacheEntry_t* entry, uint32_t ttl);
+    void _cacheRecord(const MDNSCacheEntry_t* record, uint32_t ttl, uint8_t cacheFlush);
+    int _cacheWants(const MDNSCacheEntry_t* record);
+    int _lookupWants(const MDNSCacheEntry_t* record);
+    int _snoopWants(const MDNSCacheEntry_t* record);
+    MDNSCacheEntry_t* _findCached(uint16_t type, const uint8_t* name, int from);
+    void _expireCache();
+    void _refreshCache();
+    void _answerFromCache(int idx);
+    void _cacheRecords(const MDNSReader_t* records, uint16_t count);
+    void _joinInstance(const MDNSReader_t* records, uint16_t count, uint8_t* name, uint16_t nameSize, MDNSJoinedInstance_t* joined);
+    void _reportJoined(int idx, const char* instanceName, const MDNSJoinedInstance_t* joined, uint32_t ttl);
+    void _reportInstances(const MDNSReader_t* records, uint16_t answerCount, uint16_t count);
+    void _recheckInstances(const MDNSReader_t* records, uint16_t count);
+#endif
+    
+    void _indexName(MDNSNameKind_t kind, uint16_t record, const uint8_t* name);
+    void _rebuildNameIndex();
+    const uint8_t* _nameForIndexEntry(const MDNSNameIndexEntry_t* entry);
     
-    uint8_t* _findFirstDotFromRight(const uint8_t* str);
     void _removeServiceRecord(int idx);
-    int _matchStringPart(const uint8_t** pCmpStr, int* pCmpLen, const uint8_t* buf, int dataLen);
-    const uint8_t* _postfixForProtocol(MDNSServiceProtocol_t proto);
-    void _finishedResolvingName(char* name, const byte ipAddr[4]);
+    void _freeServiceRecord(int idx);
+    void _sendGoodbyes(const MDNSAnswerSet_t* answers);
     
 public:
     BonjourClass();
@@ -119,7 +429,10 @@ public:
     
     int begin();
     int begin(const char* bonjourName);
-    void run();
+    // does whatever is due, and returns the number of milliseconds until it should be called
+    // again. it's never more than a short while, since queries may arrive at any time.
+    unsigned long run();
+    void end();
     
     virtual int beginPacket(IPAddress ip, uint16_t port);
     virtual size_t write(const uint8_t* buffer, size_t len);
@@ -135,15 +448,46 @@ public:
       
     void removeAllServiceRecords();
     
+    // number of answers left out because the querier listed them as already known
+    unsigned long suppressedAnswerCount();
+    
+#if defined(HAS_NAME_BROWSING) && HAS_NAME_BROWSING
+    // resolveName() and startDiscoveringService() without a callback run one lookup at a time,
+    // reporting to the callback set for them. with a callback of their own, they run
+    // alongside any others.
+    // answers that are still cached are reported right away, before these return.
+    // service lookups report an instance once, and after that only when it changes or goes away.
     void setNameResolvedCallback(BonjourNameFoundCallback newCallback);
     int resolveName(const char* name, unsigned long timeout);
+    int resolveName(const char* name, unsigned long timeout, BonjourNameLookupCallback callback, void* context);
     void cancelResolveName();
+    void cancelResolveName(const char* name);
     int isResolvingName();
     
     void setServiceFoundCallback(BonjourServiceFoundCallback newCallback);
     int startDiscoveringService(const char* serviceName, MDNSServiceProtocol_t proto, unsigned long timeout);
+    int startDiscoveringService(const char* serviceName, MDNSServiceProtocol_t proto, unsigned long timeout,
+                                BonjourServiceLookupCallback callback, void* context);
     void stopDiscoveringService();
+    void stopDiscoveringService(const char* serviceName, MDNSServiceProtocol_t proto);
     int isDiscoveringService();
+    
+    // looks up one instance of a service type by its name, e.g. "Kitchen._http", and reports
+    // its address, port and TXT record like an instance found by startDiscoveringService()
+    int resolveService(const char* instanceName, MDNSServiceProtocol_t proto, unsigned long timeout);
+    int resolveService(const char* instanceName, MDNSServiceProtocol_t proto, unsigned long timeout,
+                       BonjourServiceLookupCallback callback, void* context);
+    void cancelResolveService();
+    void cancelResolveService(const char* instanceName, MDNSServiceProtocol_t proto);
+    int isResolvingService();
+    
+    // keeps what other hosts announce in the cache, without looking for it, so that later
+    // lookups are answered from there. with a service type, only its instances and their
+    // hosts are kept; several types can be snooped on at once.
+    int startSnooping();
+    int startSnooping(const char* serviceName, MDNSServiceProtocol_t proto);
+    void stopSnooping();
+#endif
 };
 
 extern BonjourClass Bonjour;
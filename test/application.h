@@ -0,0 +1,58 @@
+// Stand-in for the Spark Core firmware headers, so that the library can be built and
+// exercised on the host. The network is a fake one, see host.h.
+
+#ifndef _HOST_APPLICATION_H_
+#define _HOST_APPLICATION_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef uint8_t byte;
+
+class IPAddress
+{
+private:
+    uint8_t _address[4];
+
+public:
+    IPAddress() { memset(_address, 0, sizeof(_address)); }
+    IPAddress(uint8_t a, uint8_t b, uint8_t c, uint8_t d) { _address[0] = a; _address[1] = b; _address[2] = c; _address[3] = d; }
+
+    uint8_t operator[](int index) const { return _address[index]; }
+    uint8_t& operator[](int index) { return _address[index]; }
+};
+
+unsigned long millis();
+long random(long howbig);
+long random(long howsmall, long howbig);
+
+// like the Spark Core's, write() sends a datagram right away
+class UDP
+{
+public:
+    virtual ~UDP() {}
+
+    uint8_t begin(uint16_t port);
+    void stop();
+
+    virtual int beginPacket(IPAddress ip, uint16_t port);
+    virtual size_t write(const uint8_t* buffer, size_t size);
+    virtual int endPacket();
+
+    int parsePacket();
+    int read(unsigned char* buffer, size_t len);
+    IPAddress remoteIP();
+    uint16_t remotePort();
+};
+
+class WiFiClass
+{
+public:
+    IPAddress localIP();
+    bool ready();
+};
+
+extern WiFiClass WiFi;
+
+#endif // _HOST_APPLICATION_H_
@@ -0,0 +1,407 @@
+// The fake network and clock, see host.h.
+
+#include <strings.h>
+
+#include "host.h"
+
+#define  HOST_MAX_QUEUED     (64)
+
+WiFiClass WiFi;
+int host_failures = 0;
+
+static unsigned long hostNow;
+static uint8_t hostLinkUp;
+static uint8_t hostSocketOpen;
+
+static HostPacket_t* hostSent;
+static int hostSentCount;
+static int hostSentSize;
+static IPAddress hostDestination;
+static uint16_t hostDestinationPort;
+
+static HostPacket_t hostQueue[HOST_MAX_QUEUED];
+static int hostQueueHead, hostQueueCount;
+static HostPacket_t hostCurrent;
+static uint16_t hostCurrentPos;
+
+unsigned long millis()
+{
+    return hostNow;
+}
+
+long random(long howbig)
+{
+    return (howbig > 0) ? rand() % howbig : 0;
+}
+
+long random(long howsmall, long howbig)
+{
+    return (howbig > howsmall) ? howsmall + random(howbig - howsmall) : howsmall;
+}
+
+IPAddress WiFiClass::localIP()
+{
+    return hostLinkUp ? IPAddress(192, 168, 1, 10) : IPAddress();
+}
+
+bool WiFiClass::ready()
+{
+    return hostLinkUp;
+}
+
+uint8_t UDP::begin(uint16_t port)
+{
+    (void)port;
+    hostSocketOpen = 1;
+    return 1;
+}
+
+void UDP::stop()
+{
+    hostSocketOpen = 0;
+}
+
+int UDP::beginPacket(IPAddress ip, uint16_t port)
+{
+    hostDestination = ip;
+    hostDestinationPort = port;
+    return 1;
+}
+
+size_t UDP::write(const uint8_t* buffer, size_t size)
+{
+    if (!hostSocketOpen || size > HOST_MAX_PACKET)
+        return 0;
+
+    if (hostSentCount == hostSentSize) {
+        hostSentSize = hostSentSize ? 2 * hostSentSize : 64;
+        hostSent = (HostPacket_t*)realloc(hostSent, hostSentSize * sizeof(HostPacket_t));
+    }
+
+    HostPacket_t* p = &hostSent[hostSentCount++];
+    p->ip = hostDestination;
+    p->port = hostDestinationPort;
+    p->len = size;
+    memcpy(p->data, buffer, size);
+    return size;
+}
+
+int UDP::endPacket()
+{
+    return 1;
+}
+
+int UDP::parsePacket()
+{
+    if (!hostSocketOpen || 0 == hostQueueCount)
+        return 0;
+
+    hostCurrent = hostQueue[hostQueueHead];
+    hostQueueHead = (hostQueueHead + 1) % HOST_MAX_QUEUED;
+    hostQueueCount--;
+    hostCurrentPos = 0;
+    return hostCurrent.len;
+}
+
+int UDP::read(unsigned char* buffer, size_t len)
+{
+    if (len > (size_t)(hostCurrent.len - hostCurrentPos))
+        len = hostCurrent.len - hostCurrentPos;
+
+    memcpy(buffer, hostCurrent.data + hostCurrentPos, len);
+    hostCurrentPos += len;
+    return len;
+}
+
+IPAddress UDP::remoteIP()
+{
+    return hostCurrent.ip;
+}
+
+uint16_t UDP::remotePort()
+{
+    return hostCurrent.port;
+}
+
+void host_reset()
+{
+    hostNow = 100000;
+    hostLinkUp = 1;
+    hostQueueHead = hostQueueCount = 0;
+    host_clear_sent();
+    srand(1);
+}
+
+void host_advance(unsigned long ms)
+{
+    hostNow += ms;
+}
+
+void host_set_link(uint8_t up)
+{
+    hostLinkUp = up;
+}
+
+int host_sent_count()
+{
+    return hostSentCount;
+}
+
+const HostPacket_t* host_sent(int idx)
+{
+    return &hostSent[idx];
+}
+
+void host_clear_sent()
+{
+    hostSentCount = 0;
+}
+
+void host_receive(const uint8_t* data, uint16_t len, IPAddress from, uint16_t port)
+{
+    if (hostQueueCount == HOST_MAX_QUEUED || len > HOST_MAX_PACKET)
+        return;
+
+    HostPacket_t* p = &hostQueue[(hostQueueHead + hostQueueCount++) % HOST_MAX_QUEUED];
+    p->ip = from;
+    p->port = port;
+    p->len = len;
+    memcpy(p->data, data, len);
+}
+
+int host_load_fixture(const char* path, uint8_t* data, uint16_t size)
+{
+    FILE* f = fopen(path, "r");
+    if (NULL == f) {
+        printf("can't open fixture %s\n", path);
+        return 0;
+    }
+
+    uint16_t len = 0;
+    int c, digits = 0, value = 0;
+
+    while (EOF != (c = fgetc(f)) && len < size)
+    {
+        if ('#' == c) {
+            while (EOF != c && '\n' != c)
+                c = fgetc(f);
+            continue;
+        }
+
+        int nibble = (c >= '0' && c <= '9') ? c - '0' : (c >= 'a' && c <= 'f') ? c - 'a' + 10 :
+                     (c >= 'A' && c <= 'F') ? c - 'A' + 10 : -1;
+        if (nibble < 0)
+            continue;
+
+        value = (value << 4) | nibble;
+        if (2 == ++digits) {
+            data[len++] = value;
+            digits = value = 0;
+        }
+    }
+
+    fclose(f);
+    return len;
+}
+
+int host_receive_fixture(const char* path, IPAddress from, uint16_t port)
+{
+    uint8_t data[HOST_MAX_PACKET];
+    int len = host_load_fixture(path, data, sizeof(data));
+
+    if (len > 0)
+        host_receive(data, len, from, port);
+    return len;
+}
+
+void host_run(BonjourClass* bonjour, unsigned long ms)
+{
+    unsigned long end = hostNow + ms;
+
+    while ((long)(end - hostNow) > 0) {
+        unsigned long wait = bonjour->run();
+        if (0 == wait)
+            wait = 1;
+        if ((long)(end - hostNow) < (long)wait)
+            wait = end - hostNow;
+        hostNow += wait;
+    }
+
+    (void)bonjour->run();
+}
+
+static void build_u16(HostPacketBuilder_t* b, uint16_t value)
+{
+    b->data[b->len++] = value >> 8;
+    b->data[b->len++] = value & 0xff;
+}
+
+static void build_u32(HostPacketBuilder_t* b, uint32_t value)
+{
+    build_u16(b, value >> 16);
+    build_u16(b, value & 0xffff);
+}
+
+static void build_name(HostPacketBuilder_t* b, const char* name)
+{
+    while (*name) {
+        const char* end = strchr(name, '.');
+        if (NULL == end)
+            end = name + strlen(name);
+
+        b->data[b->len++] = end - name;
+        memcpy(b->data + b->len, name, end - name);
+        b->len += end - name;
+        name = *end ? end + 1 : end;
+    }
+
+    b->data[b->len++] = 0;
+}
+
+void build_begin(HostPacketBuilder_t* b, uint16_t flags)
+{
+    memset(b, 0, sizeof(*b));
+    b->rclass = 0x0001;
+    build_u16(b, 0);
+    build_u16(b, flags);
+    b->len = 12;
+}
+
+void build_question(HostPacketBuilder_t* b, const char* name, uint16_t type, uint16_t qclass)
+{
+    build_name(b, name);
+    build_u16(b, type);
+    build_u16(b, qclass);
+    b->counts[0]++;
+}
+
+// everything of a record up to its data; the data length is filled in afterwards
+static uint16_t build_record(HostPacketBuilder_t* b, int section, const char* name, uint16_t type, uint32_t ttl)
+{
+    build_name(b, name);
+    build_u16(b, type);
+    build_u16(b, b->rclass);
+    build_u32(b, ttl);
+    build_u16(b, 0);
+    b->counts[section]++;
+    return b->len;
+}
+
+static void build_data_length(HostPacketBuilder_t* b, uint16_t dataPos)
+{
+    uint16_t len = b->len - dataPos;
+    b->data[dataPos - 2] = len >> 8;
+    b->data[dataPos - 1] = len & 0xff;
+}
+
+void build_a(HostPacketBuilder_t* b, int section, const char* name, uint32_t ttl, const uint8_t addr[4])
+{
+    uint16_t dataPos = build_record(b, section, name, 0x01, ttl);
+    memcpy(b->data + b->len, addr, 4);
+    b->len += 4;
+    build_data_length(b, dataPos);
+}
+
+void build_ptr(HostPacketBuilder_t* b, int section, const char* name, uint32_t ttl, const char* target)
+{
+    uint16_t dataPos = build_record(b, section, name, 0x0c, ttl);
+    build_name(b, target);
+    build_data_length(b, dataPos);
+}
+
+void build_srv(HostPacketBuilder_t* b, int section, const char* name, uint32_t ttl, uint16_t port, const char* target)
+{
+    uint16_t dataPos = build_record(b, section, name, 0x21, ttl);
+    build_u16(b, 0);
+    build_u16(b, 0);
+    build_u16(b, port);
+    build_name(b, target);
+    build_data_length(b, dataPos);
+}
+
+// the text is given as length-prefixed strings, like the TXT content of a service record
+void build_txt(HostPacketBuilder_t* b, int section, const char* name, uint32_t ttl, const char* text)
+{
+    uint16_t dataPos = build_record(b, section, name, 0x10, ttl);
+    uint16_t len = strlen(text);
+    if (0 == len)
+        b->data[b->len++] = 0;
+    memcpy(b->data + b->len, text, len);
+    b->len += len;
+    build_data_length(b, dataPos);
+}
+
+void build_end(HostPacketBuilder_t* b)
+{
+    for (int i = 0; i < 4; i++) {
+        b->data[4 + 2*i] = b->counts[i] >> 8;
+        b->data[5 + 2*i] = b->counts[i] & 0xff;
+    }
+}
+
+// decodes the name at a packet offset as a dotted string, and returns the offset after it
+static uint16_t packet_name(const HostPacket_t* p, uint16_t pos, char* out)
+{
+    uint16_t end = 0;
+    int len = 0, jumps = 0;
+
+    out[0] = '\0';
+    while (pos < p->len && jumps < 16) {
+        uint8_t labelLen = p->data[pos];
+
+        if (0xc0 == (labelLen & 0xc0)) {
+            if (0 == end)
+                end = pos + 2;
+            pos = ((labelLen & 0x3f) << 8) | p->data[pos + 1];
+            jumps++;
+            continue;
+        }
+
+        if (0 == labelLen)
+            break;
+
+        if (len > 0)
+            out[len++] = '.';
+        memcpy(out + len, p->data + pos + 1, labelLen);
+        len += labelLen;
+        out[len] = '\0';
+        pos += 1 + labelLen;
+    }
+
+    return end ? end : pos + 1;
+}
+
+static uint16_t packet_u16(const HostPacket_t* p, uint16_t pos)
+{
+    return (p->data[pos] << 8) | p->data[pos + 1];
+}
+
+static int packet_find(const HostPacket_t* p, int question, uint16_t type, const char* name)
+{
+    char found[256];
+    uint16_t pos = 12;
+    int questions = packet_u16(p, 4);
+    int records = packet_u16(p, 6) + packet_u16(p, 8) + packet_u16(p, 10);
+
+    for (int i = 0; i < questions + records && pos < p->len; i++) {
+        pos = packet_name(p, pos, found);
+        uint16_t foundType = packet_u16(p, pos);
+
+        if ((i < questions) == question && type == foundType && 0 == strcasecmp(found, name))
+            return 1;
+
+        pos += (i < questions) ? 4 : 10 + packet_u16(p, pos + 8);
+    }
+
+    return 0;
+}
+
+int packet_has_record(const HostPacket_t* p, uint16_t type, const char* name)
+{
+    return packet_find(p, 0, type, name);
+}
+
+int packet_has_question(const HostPacket_t* p, uint16_t type, const char* name)
+{
+    return packet_find(p, 1, type, name);
+}
@@ -0,0 +1,69 @@
+// The fake network and clock the library runs on in the host tests, and a few helpers
+// to put packets together and look into the ones sent.
+
+#ifndef _HOST_H_
+#define _HOST_H_
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "Bonjour.h"
+
+#define  HOST_MAX_PACKET     (1500)
+
+typedef struct _HostPacket_t {
+    IPAddress       ip;
+    uint16_t        port;
+    uint16_t        len;
+    uint8_t         data[HOST_MAX_PACKET];
+} HostPacket_t;
+
+// the clock only moves when it's told to
+void host_reset();
+void host_advance(unsigned long ms);
+
+// the link is up with our address from the start
+void host_set_link(uint8_t up);
+
+// packets sent by the library, oldest first
+int host_sent_count();
+const HostPacket_t* host_sent(int idx);
+void host_clear_sent();
+
+// queues a packet to be received; fixtures are hex dumps, '#' starts a comment
+void host_receive(const uint8_t* data, uint16_t len, IPAddress from, uint16_t port);
+int host_receive_fixture(const char* path, IPAddress from, uint16_t port);
+int host_load_fixture(const char* path, uint8_t* data, uint16_t size);
+
+// calls run() for the given time, moving the clock along as far as run() asks for
+void host_run(BonjourClass* bonjour, unsigned long ms);
+
+// a packet put together record by record, with uncompressed names given as dotted strings.
+// sections are 1 for answers, 2 for authorities and 3 for additionals, and have to be
+// written in that order.
+typedef struct _HostPacketBuilder_t {
+    uint8_t         data[HOST_MAX_PACKET];
+    uint16_t        len;
+    uint16_t        counts[4];      // questions, answers, authorities, additionals
+    uint16_t        rclass;         // of the records that follow, IN unless changed
+} HostPacketBuilder_t;
+
+void build_begin(HostPacketBuilder_t* b, uint16_t flags);
+void build_question(HostPacketBuilder_t* b, const char* name, uint16_t type, uint16_t qclass);
+void build_a(HostPacketBuilder_t* b, int section, const char* name, uint32_t ttl, const uint8_t addr[4]);
+void build_ptr(HostPacketBuilder_t* b, int section, const char* name, uint32_t ttl, const char* target);
+void build_srv(HostPacketBuilder_t* b, int section, const char* name, uint32_t ttl, uint16_t port, const char* target);
+void build_txt(HostPacketBuilder_t* b, int section, const char* name, uint32_t ttl, const char* text);
+void build_end(HostPacketBuilder_t* b);
+
+// whether a sent packet holds a record (in any section) or a question of a type and
+// dotted name, following compression pointers
+int packet_has_record(const HostPacket_t* p, uint16_t type, const char* name);
+int packet_has_question(const HostPacket_t* p, uint16_t type, const char* name);
+
+extern int host_failures;
+
+#define  CHECK(cond) \
+    do { if (!(cond)) { printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); host_failures++; } } while (0)
+
+#endif // _HOST_H_
@@ -0,0 +1,304 @@
+// Browsing for service instances, with other hosts answering.
+
+#include "host.h"
+
+static const uint8_t kitchenAddr[4] = { 192, 168, 1, 21 };
+
+static int added, updated, removed;
+static char lastTxt[64];
+static uint8_t lastAddr[4];
+
+static void countEvents(const char* type, MDNSServiceProtocol_t proto, MDNSServiceEvent_t event, const char* instanceName,
+                        const byte ipAddr[4], unsigned short port, const char* txtContent, void* context)
+{
+    (void)type; (void)proto; (void)port; (void)context;
+
+    if (NULL == instanceName)
+        return;
+
+    if (NULL != ipAddr)
+        memcpy(lastAddr, ipAddr, 4);
+    snprintf(lastTxt, sizeof(lastTxt), "%s", (NULL != txtContent) ? txtContent : "");
+
+    if (MDNSServiceAdded == event)
+        added++;
+    else if (MDNSServiceUpdated == event)
+        updated++;
+    else
+        removed++;
+}
+
+static void startBrowsing()
+{
+    host_reset();
+    added = updated = removed = 0;
+
+    CHECK(Bonjour.begin("browser"));
+    host_run(&Bonjour, 2000);
+    CHECK(Bonjour.startDiscoveringService("_http", MDNSServiceTCP, 0, countEvents, NULL));
+}
+
+// like this library does, the host answers every question about its instance with all of
+// its records, each with a TTL of two minutes
+static void kitchenAnswers(int* questions)
+{
+    int asked = 0;
+
+    for (int k = 0; k < host_sent_count(); k++) {
+        const HostPacket_t* p = host_sent(k);
+        asked |= packet_has_question(p, 0x0c, "_http._tcp.local") ||
+                 packet_has_question(p, 0x21, "Kitchen._http._tcp.local") ||
+                 packet_has_question(p, 0x01, "kitchen.local");
+    }
+    host_clear_sent();
+
+    if (!asked)
+        return;
+
+    HostPacketBuilder_t response;
+    build_begin(&response, 0x8400);
+    build_ptr(&response, 1, "_http._tcp.local", 120, "Kitchen._http._tcp.local");
+    response.rclass = 0x8001;
+    build_srv(&response, 3, "Kitchen._http._tcp.local", 120, 80, "kitchen.local");
+    build_txt(&response, 3, "Kitchen._http._tcp.local", 120, "");
+    build_a(&response, 3, "kitchen.local", 120, kitchenAddr);
+    build_end(&response);
+    host_receive(response.data, response.len, IPAddress(192, 168, 1, 21), 5353);
+
+    (*questions)++;
+}
+
+// questions back off to intervals far longer than the TTLs; the records are asked for again
+// before they expire, so the instance stays
+static void testRefreshBeforeExpiry()
+{
+    int questions = 0;
+
+    startBrowsing();
+    for (int t = 0; t < 15 * 60 * 10; t++) {
+        host_run(&Bonjour, 100);
+        kitchenAnswers(&questions);
+    }
+
+    CHECK(1 == added);
+    CHECK(0 == removed);
+    CHECK(questions > 15 * 60 / 120);
+
+    Bonjour.end();
+}
+
+// an instance changes with a new TXT record, or a new address of its host, on their own
+// (RFC 6762 8.4); no PTR record comes along with them
+static void testUpdateWithoutPTR()
+{
+    static const uint8_t newAddr[4] = { 192, 168, 1, 22 };
+    int questions = 0;
+
+    startBrowsing();
+    host_run(&Bonjour, 2000);
+    kitchenAnswers(&questions);
+    host_run(&Bonjour, 2000);
+    CHECK(1 == added);
+
+    HostPacketBuilder_t txt;
+    build_begin(&txt, 0x8400);
+    txt.rclass = 0x8001;
+    build_txt(&txt, 1, "Kitchen._http._tcp.local", 120, "\x03" "a=b");
+    build_end(&txt);
+    host_receive(txt.data, txt.len, IPAddress(192, 168, 1, 21), 5353);
+    host_run(&Bonjour, 100);
+
+    CHECK(1 == updated);
+    CHECK(0 == strcmp("\x03" "a=b", lastTxt));
+
+    // the same record once more is no change
+    host_advance(2000);
+    host_receive(txt.data, txt.len, IPAddress(192, 168, 1, 21), 5353);
+    host_run(&Bonjour, 100);
+    CHECK(1 == updated);
+
+    HostPacketBuilder_t a;
+    build_begin(&a, 0x8400);
+    a.rclass = 0x8001;
+    build_a(&a, 1, "kitchen.local", 120, newAddr);
+    build_end(&a);
+    host_receive(a.data, a.len, IPAddress(192, 168, 1, 22), 5353);
+    host_run(&Bonjour, 100);
+
+    CHECK(2 == updated);
+    CHECK(0 == memcmp(newAddr, lastAddr, 4));
+    CHECK(0 == strcmp("\x03" "a=b", lastTxt));
+    CHECK(1 == added);
+    CHECK(0 == removed);
+
+    Bonjour.end();
+}
+
+// more instances than there's room for in the table, each in a packet of its own; every one
+// of them is reported
+static void testMoreInstancesThanSlots()
+{
+    char instance[64], host[32];
+
+    // the cache outlives end(); what earlier tests left there doesn't count
+    startBrowsing();
+    added = updated = removed = 0;
+
+    for (int i = 0; i < MDNS_MAX_INSTANCES + 2; i++) {
+        const uint8_t addr[4] = { 192, 168, 1, (uint8_t)(100 + i) };
+        HostPacketBuilder_t response;
+
+        snprintf(instance, sizeof(instance), "Room %d._http._tcp.local", i);
+        snprintf(host, sizeof(host), "room%d.local", i);
+
+        build_begin(&response, 0x8400);
+        build_ptr(&response, 1, "_http._tcp.local", 120, instance);
+        response.rclass = 0x8001;
+        build_srv(&response, 3, instance, 120, 80, host);
+        build_a(&response, 3, host, 120, addr);
+        build_end(&response);
+        host_receive(response.data, response.len, IPAddress(192, 168, 1, 100 + i), 5353);
+        host_run(&Bonjour, 100);
+    }
+
+    CHECK(MDNS_MAX_INSTANCES + 2 == added);
+    CHECK(0 == removed);
+
+    Bonjour.end();
+}
+
+static void ignoreName(const char* name, const byte ipAddr[4], void* context)
+{
+    (void)name; (void)ipAddr; (void)context;
+}
+
+static uint16_t questionCount(const HostPacket_t* p)
+{
+    return (p->data[4] << 8) | p->data[5];
+}
+
+// questions that take more than one packet: the answers we already know to the questions of
+// a packet go out right after it, not after the questions of the next one. every packet with
+// more of them to follow is marked truncated.
+// it runs first: the cache has room for few records, and the other tests leave theirs there
+static void testKnownAnswersFollowTheirQuestions()
+{
+    char instance[64], name[128];
+    HostPacketBuilder_t response;
+    const HostPacket_t* last = NULL;
+    int lastQuestions = 0;
+
+    host_reset();
+    CHECK(Bonjour.begin("browser"));
+    host_run(&Bonjour, 2000);
+
+    // the instances are cached, and stay so after the browse has stopped
+    CHECK(Bonjour.startDiscoveringService("_ipp", MDNSServiceTCP, 0, countEvents, NULL));
+    host_run(&Bonjour, 100);
+    build_begin(&response, 0x8400);
+    for (int i = 0; i < 4; i++) {
+        snprintf(instance, sizeof(instance), "A printer with a rather long name %d._ipp._tcp.local", i);
+        build_ptr(&response, 1, "_ipp._tcp.local", 120, instance);
+    }
+    build_end(&response);
+    host_receive(response.data, response.len, IPAddress(192, 168, 1, 30), 5353);
+    host_run(&Bonjour, 100);
+    Bonjour.stopDiscoveringService("_ipp", MDNSServiceTCP);
+
+    // the browse comes first, the names' questions take more than the rest of its packet
+    CHECK(Bonjour.startDiscoveringService("_ipp", MDNSServiceTCP, 0, countEvents, NULL));
+    for (int i = 0; i < MDNS_MAX_QUERIES - 1; i++) {
+        snprintf(name, sizeof(name), "a-host-with-a-name-long-enough.to-fill-packets-quickly-with-questions-%d", i);
+        CHECK(Bonjour.resolveName(name, 5000, ignoreName, NULL));
+    }
+    host_clear_sent();
+    host_run(&Bonjour, 100);
+
+    for (int k = 0; k < host_sent_count(); k++) {
+        const HostPacket_t* p = host_sent(k);
+        int truncated = 0 != (p->data[2] & 0x02);
+        int more = k + 1 < host_sent_count() && 0 == questionCount(host_sent(k + 1));
+
+        CHECK(truncated == more);
+        if (questionCount(p) > 0) {
+            last = p;
+            lastQuestions = k;
+        }
+    }
+    CHECK(host_sent_count() > 2 && lastQuestions > 1);
+    CHECK(packet_has_question(host_sent(0), 0x0c, "_ipp._tcp.local"));
+    snprintf(name, sizeof(name), "a-host-with-a-name-long-enough.to-fill-packets-quickly-with-questions-%d.local", MDNS_MAX_QUERIES - 2);
+    CHECK(NULL != last && packet_has_question(last, 0x01, name));
+
+    // all four instances, before the last of the questions
+    int known = 0;
+    for (int k = 0; k < lastQuestions; k++)
+        if (packet_has_record(host_sent(k), 0x0c, "_ipp._tcp.local"))
+            known += (host_sent(k)->data[6] << 8) | host_sent(k)->data[7];
+    CHECK(4 == known);
+
+    Bonjour.end();
+}
+
+static int legacyCalls, legacyWithoutAddress;
+
+static void legacyFound(const char* type, MDNSServiceProtocol_t proto, const char* instanceName,
+                        const byte ipAddr[4], unsigned short port, const char* txtContent)
+{
+    (void)type; (void)proto; (void)instanceName; (void)port; (void)txtContent;
+
+    legacyCalls++;
+    if (NULL == ipAddr)
+        legacyWithoutAddress++;
+}
+
+// the global callback has no event to tell a removal by: it hears of the instance, not of
+// its goodbye
+static void testLegacyCallbackWithoutRemovals()
+{
+    HostPacketBuilder_t response, goodbye;
+
+    host_reset();
+    CHECK(Bonjour.begin("browser"));
+    host_run(&Bonjour, 2000);
+    Bonjour.setServiceFoundCallback(legacyFound);
+    CHECK(Bonjour.startDiscoveringService("_http", MDNSServiceTCP, 0));
+    host_run(&Bonjour, 100);
+
+    // the cache outlives end(); what earlier tests left there doesn't count
+    legacyCalls = legacyWithoutAddress = 0;
+
+    build_begin(&response, 0x8400);
+    build_ptr(&response, 1, "_http._tcp.local", 120, "Hall._http._tcp.local");
+    response.rclass = 0x8001;
+    build_srv(&response, 3, "Hall._http._tcp.local", 120, 80, "hall.local");
+    build_a(&response, 3, "hall.local", 120, kitchenAddr);
+    build_end(&response);
+    host_receive(response.data, response.len, IPAddress(192, 168, 1, 21), 5353);
+    host_run(&Bonjour, 100);
+    CHECK(1 == legacyCalls);
+
+    build_begin(&goodbye, 0x8400);
+    build_ptr(&goodbye, 1, "_http._tcp.local", 0, "Hall._http._tcp.local");
+    build_end(&goodbye);
+    host_receive(goodbye.data, goodbye.len, IPAddress(192, 168, 1, 21), 5353);
+    host_run(&Bonjour, 100);
+
+    CHECK(1 == legacyCalls);
+    CHECK(0 == legacyWithoutAddress);
+
+    Bonjour.end();
+    Bonjour.setServiceFoundCallback(NULL);
+}
+
+int main()
+{
+    testKnownAnswersFollowTheirQuestions();
+    testRefreshBeforeExpiry();
+    testUpdateWithoutPTR();
+    testMoreInstancesThanSlots();
+    testLegacyCallbackWithoutRemovals();
+
+    printf("browse: %s\n", host_failures ? "failed" : "ok");
+    return host_failures ? 1 : 0;
+}
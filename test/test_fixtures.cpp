@@ -0,0 +1,126 @@
+// Responses carrying several hosts at once, as a sleep proxy or a reflector sends them,
+// replayed from fixtures/*.hex.
+
+#include "host.h"
+
+typedef struct {
+    const char*     name;
+    uint8_t         addr[4];
+    unsigned short  port;
+    const char*     txt;            // as reported: length-prefixed strings
+} Expected_t;
+
+static const Expected_t expected[] = {
+    { "Kitchen", { 192, 168, 1, 21 }, 80,   "\x0d" "path=/kitchen" },
+    { "Garage",  { 192, 168, 1, 22 }, 8080, "\x1c" "path=/garage/door/controller" "\x11" "model=opener-2000" },
+    { "Attic",   { 192, 168, 1, 23 }, 8081, "\x1f" "path=/attic/sensors/temperature" "\x0c" "unit=celsius" },
+};
+#define  EXPECTED_COUNT  (int)(sizeof(expected) / sizeof(expected[0]))
+
+static int found[EXPECTED_COUNT];
+static int mismatches;
+static int withTxt;             // the reflector doesn't pass on TXT records
+
+// every instance has to come with the address, port and TXT record of its own host
+static void checkInstance(const char* type, MDNSServiceProtocol_t proto, MDNSServiceEvent_t event, const char* instanceName,
+                          const byte ipAddr[4], unsigned short port, const char* txtContent, void* context)
+{
+    (void)type; (void)proto; (void)context;
+
+    if (NULL == instanceName || MDNSServiceAdded != event)
+        return;
+
+    for (int i = 0; i < EXPECTED_COUNT; i++) {
+        if (0 != strcmp(expected[i].name, instanceName))
+            continue;
+
+        found[i]++;
+        if (NULL == ipAddr || 0 != memcmp(expected[i].addr, ipAddr, 4) || expected[i].port != port ||
+            (withTxt ? (NULL == txtContent || 0 != strcmp(expected[i].txt, txtContent)) : NULL != txtContent)) {
+            printf("%s: %d.%d.%d.%d port %u\n", instanceName, ipAddr ? ipAddr[0] : 0, ipAddr ? ipAddr[1] : 0,
+                   ipAddr ? ipAddr[2] : 0, ipAddr ? ipAddr[3] : 0, port);
+            mismatches++;
+        }
+        return;
+    }
+
+    mismatches++;
+}
+
+static void start(int txt)
+{
+    host_reset();
+    memset(found, 0, sizeof(found));
+    mismatches = 0;
+    withTxt = txt;
+
+    CHECK(Bonjour.begin("fixtures"));
+    host_run(&Bonjour, 2000);
+}
+
+// three instances in one packet; their addresses come ahead of their SRV records, and the
+// host names are compressed against each other
+static void testSleepProxyBrowse()
+{
+    start(1);
+    CHECK(Bonjour.startDiscoveringService("_http", MDNSServiceTCP, 0, checkInstance, NULL));
+    host_run(&Bonjour, 100);
+
+    CHECK(host_receive_fixture("fixtures/sleep_proxy.hex", IPAddress(192, 168, 1, 5), 5353));
+    host_run(&Bonjour, 100);
+
+    for (int i = 0; i < EXPECTED_COUNT; i++)
+        CHECK(1 == found[i]);
+    CHECK(0 == mismatches);
+
+    Bonjour.end();
+}
+
+// the instance looked for by name is picked out of the same packet
+static void testSleepProxyResolve()
+{
+    start(1);
+    CHECK(Bonjour.resolveService("Attic._http", MDNSServiceTCP, 5000, checkInstance, NULL));
+    host_run(&Bonjour, 100);
+
+    CHECK(host_receive_fixture("fixtures/sleep_proxy.hex", IPAddress(192, 168, 1, 5), 5353));
+    host_run(&Bonjour, 100);
+
+    CHECK(0 == found[0] && 0 == found[1] && 1 == found[2]);
+    CHECK(0 == mismatches);
+    CHECK(!Bonjour.isResolvingService());
+
+    Bonjour.end();
+}
+
+// the SRV records come in one packet and the addresses in the next, in another order
+static void testReflectorResolve()
+{
+    start(0);
+    CHECK(Bonjour.resolveService("Garage._http", MDNSServiceTCP, 5000, checkInstance, NULL));
+    host_run(&Bonjour, 100);
+
+    CHECK(host_receive_fixture("fixtures/reflector_srv.hex", IPAddress(192, 168, 1, 6), 5353));
+    host_run(&Bonjour, 100);
+    CHECK(0 == found[1]);
+
+    CHECK(host_receive_fixture("fixtures/reflector_a.hex", IPAddress(192, 168, 1, 6), 5353));
+    host_run(&Bonjour, 100);
+
+    CHECK(0 == found[0] && 1 == found[1] && 0 == found[2]);
+    CHECK(0 == mismatches);
+    CHECK(!Bonjour.isResolvingService());
+
+    Bonjour.end();
+}
+
+int main()
+{
+    // the cache outlives end(), so the host with records in both fixtures goes first
+    testReflectorResolve();
+    testSleepProxyBrowse();
+    testSleepProxyResolve();
+
+    printf("fixtures: %s\n", host_failures ? "failed" : "ok");
+    return host_failures ? 1 : 0;
+}
@@ -0,0 +1,85 @@
+// Queries from simple resolvers, sent from a port other than 5353 (RFC 6762 6.7): they're
+// answered by unicast, with the questions repeated when they fit into the reply.
+
+#include "host.h"
+
+#define  LEGACY_PORT     (53000)
+
+static uint16_t questionCount(const HostPacket_t* p)
+{
+    return (p->data[4] << 8) | p->data[5];
+}
+
+static const HostPacket_t* replyTo(uint16_t port)
+{
+    for (int k = 0; k < host_sent_count(); k++)
+        if (port == host_sent(k)->port)
+            return host_sent(k);
+    return NULL;
+}
+
+static void testQuestionRepeated()
+{
+    HostPacketBuilder_t query;
+
+    build_begin(&query, 0);
+    build_question(&query, "legacy.local", 0x01, 0x0001);
+    build_end(&query);
+
+    host_clear_sent();
+    host_receive(query.data, query.len, IPAddress(192, 168, 1, 40), LEGACY_PORT);
+    host_run(&Bonjour, 100);
+
+    const HostPacket_t* reply = replyTo(LEGACY_PORT);
+    CHECK(NULL != reply);
+    if (NULL == reply)
+        return;
+
+    CHECK(1 == questionCount(reply));
+    CHECK(packet_has_question(reply, 0x01, "legacy.local"));
+    CHECK(packet_has_record(reply, 0x01, "legacy.local"));
+}
+
+// the questions fit into the receive buffer but not into the reply; they're left out of
+// it, and the reply doesn't claim to have them
+static void testQuestionsTooLong()
+{
+    HostPacketBuilder_t query;
+    char name[64];
+
+    build_begin(&query, 0);
+    build_question(&query, "legacy.local", 0x01, 0x0001);
+    for (int i = 0; i < 16; i++) {
+        snprintf(name, sizeof(name), "a-rather-long-service-name-%02d._http._tcp.local", i);
+        build_question(&query, name, 0x21, 0x0001);
+    }
+    build_end(&query);
+    CHECK(query.len > MDNS_WRITE_BUFFER_SIZE && query.len <= MDNS_READ_BUFFER_SIZE);
+
+    host_clear_sent();
+    host_receive(query.data, query.len, IPAddress(192, 168, 1, 40), LEGACY_PORT);
+    host_run(&Bonjour, 100);
+
+    const HostPacket_t* reply = replyTo(LEGACY_PORT);
+    CHECK(NULL != reply);
+    if (NULL == reply)
+        return;
+
+    CHECK(0 == questionCount(reply));
+    CHECK(packet_has_record(reply, 0x01, "legacy.local"));
+}
+
+int main()
+{
+    host_reset();
+    CHECK(Bonjour.begin("legacy"));
+    host_run(&Bonjour, 10000);
+
+    testQuestionRepeated();
+    testQuestionsTooLong();
+
+    Bonjour.end();
+
+    printf("legacy: %s\n", host_failures ? "failed" : "ok");
+    return host_failures ? 1 : 0;
+}
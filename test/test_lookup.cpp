@@ -0,0 +1,176 @@
+// Lookups started from the callbacks of lookups that just ended.
+
+#include "host.h"
+
+static int timeouts;
+
+// the lookup without a callback of its own timed out; it's started again (in the same
+// slot, since starting it cancels the one that ended), and has to stay
+static void retryOnTimeout(const char* type, MDNSServiceProtocol_t proto, const char* instanceName,
+                           const byte ipAddr[4], unsigned short port, const char* txtContent)
+{
+    (void)ipAddr; (void)port; (void)txtContent;
+
+    if (NULL == instanceName && 0 == timeouts++)
+        CHECK(Bonjour.startDiscoveringService(type, proto, 0));
+}
+
+static void testRetryAfterTimeout()
+{
+    host_reset();
+    CHECK(Bonjour.begin("lookup"));
+    host_run(&Bonjour, 2000);
+
+    timeouts = 0;
+    Bonjour.setServiceFoundCallback(retryOnTimeout);
+    CHECK(Bonjour.startDiscoveringService("_http", MDNSServiceTCP, 3000));
+    host_run(&Bonjour, 4000);
+
+    CHECK(1 == timeouts);
+    CHECK(Bonjour.isDiscoveringService());
+
+    Bonjour.end();
+}
+
+static int resolved;
+
+// the first instance is found; another one is looked for right away, in the same slot
+static void resolveNext(const char* type, MDNSServiceProtocol_t proto, const char* instanceName,
+                        const byte ipAddr[4], unsigned short port, const char* txtContent)
+{
+    (void)type; (void)txtContent;
+
+    if (NULL == instanceName || NULL == ipAddr)
+        return;
+
+    CHECK(0 == strcmp("Kitchen", instanceName) && 8080 == port && 21 == ipAddr[3]);
+    if (resolved++ < 2)
+        CHECK(Bonjour.resolveService("Hall._http", proto, 5000));
+}
+
+static void testResolveFromCallback()
+{
+    static const uint8_t kitchenAddr[4] = { 192, 168, 1, 21 };
+    HostPacketBuilder_t response;
+
+    host_reset();
+    CHECK(Bonjour.begin("lookup"));
+    host_run(&Bonjour, 2000);
+
+    resolved = 0;
+    Bonjour.setServiceFoundCallback(resolveNext);
+    CHECK(Bonjour.resolveService("Kitchen._http", MDNSServiceTCP, 5000));
+    host_run(&Bonjour, 100);
+
+    build_begin(&response, 0x8400);
+    build_srv(&response, 1, "Kitchen._http._tcp.local", 120, 8080, "kitchen.local");
+    build_txt(&response, 1, "Kitchen._http._tcp.local", 4500, "\x03" "a=b");
+    build_a(&response, 3, "kitchen.local", 120, kitchenAddr);
+    build_end(&response);
+    host_receive(response.data, response.len, IPAddress(192, 168, 1, 21), 5353);
+    host_run(&Bonjour, 100);
+
+    CHECK(1 == resolved);
+    CHECK(Bonjour.isResolvingService());
+
+    // answered from the cache this time, before resolveService() returns
+    Bonjour.cancelResolveService();
+    CHECK(Bonjour.resolveService("Kitchen._http", MDNSServiceTCP, 5000));
+    CHECK(2 == resolved);
+    CHECK(Bonjour.isResolvingService());
+
+    Bonjour.end();
+}
+
+static int nameReports;
+static uint8_t nameAddr[4];
+
+static void nameFound(const char* name, const byte ipAddr[4], void* context)
+{
+    (void)name; (void)context;
+
+    nameReports++;
+    if (NULL != ipAddr)
+        memcpy(nameAddr, ipAddr, 4);
+}
+
+// a goodbye for the address says it's no longer valid; the lookup waits for a real one
+static void testGoodbyeDoesNotResolve()
+{
+    static const uint8_t oldAddr[4] = { 10, 0, 0, 9 };
+    static const uint8_t newAddr[4] = { 10, 0, 0, 10 };
+    HostPacketBuilder_t goodbye, response;
+
+    host_reset();
+    CHECK(Bonjour.begin("lookup"));
+    host_run(&Bonjour, 2000);
+
+    nameReports = 0;
+    CHECK(Bonjour.resolveName("peer", 5000, nameFound, NULL));
+    host_run(&Bonjour, 100);
+
+    build_begin(&goodbye, 0x8400);
+    build_a(&goodbye, 1, "peer.local", 0, oldAddr);
+    build_end(&goodbye);
+    host_receive(goodbye.data, goodbye.len, IPAddress(10, 0, 0, 9), 5353);
+    host_run(&Bonjour, 100);
+
+    CHECK(0 == nameReports);
+    CHECK(Bonjour.isResolvingName());
+
+    build_begin(&response, 0x8400);
+    build_a(&response, 1, "peer.local", 120, newAddr);
+    build_end(&response);
+    host_receive(response.data, response.len, IPAddress(10, 0, 0, 10), 5353);
+    host_run(&Bonjour, 100);
+
+    CHECK(1 == nameReports);
+    CHECK(0 == memcmp(newAddr, nameAddr, 4));
+
+    Bonjour.end();
+}
+
+// a response filled up to an Ethernet MTU, with the address looked for at its very end
+static void testAddressAtEndOfFullPacket()
+{
+    static const uint8_t otherAddr[4] = { 10, 0, 0, 1 };
+    static const uint8_t farAddr[4] = { 10, 0, 0, 11 };
+    HostPacketBuilder_t response;
+    char name[32];
+
+    host_reset();
+    CHECK(Bonjour.begin("lookup"));
+    host_run(&Bonjour, 2000);
+
+    nameReports = 0;
+    CHECK(Bonjour.resolveName("far", 5000, nameFound, NULL));
+    host_run(&Bonjour, 100);
+
+    build_begin(&response, 0x8400);
+    for (int i = 0; i < 48; i++) {
+        snprintf(name, sizeof(name), "other%02d.local", i);
+        build_a(&response, 1, name, 120, otherAddr);
+    }
+    build_a(&response, 1, "far.local", 120, farAddr);
+    build_end(&response);
+    CHECK(response.len > 1400 && response.len <= 1472);
+
+    host_receive(response.data, response.len, IPAddress(10, 0, 0, 11), 5353);
+    host_run(&Bonjour, 100);
+
+    CHECK(1 == nameReports);
+    CHECK(0 == memcmp(farAddr, nameAddr, 4));
+
+    Bonjour.end();
+}
+
+int main()
+{
+    testRetryAfterTimeout();
+    testResolveFromCallback();
+    testGoodbyeDoesNotResolve();
+    testAddressAtEndOfFullPacket();
+
+    printf("lookup: %s\n", host_failures ? "failed" : "ok");
+    return host_failures ? 1 : 0;
+}
@@ -0,0 +1,197 @@
+// Times the packet parser on its own, on a corpus of queries and responses as other hosts
+// send them (fixtures/query_*.hex, fixtures/sleep_proxy.hex), next to the parser it
+// replaced: that one malloc()ed a copy of every packet and memcpy()d it into a scratch
+// header a few bytes at a time, matching the question names label by label against
+// every name of ours on the way.
+//
+// The library is built into this test, so the reader it uses internally can be timed.
+
+#include <time.h>
+
+#include "host.h"
+#include "Bonjour.cpp"
+
+#define  PARSER_ROUNDS   (2000)
+#define  PARSER_BATCHES  (10)
+
+static const char* corpus[] = {
+    "fixtures/query_ios.hex",
+    "fixtures/query_avahi.hex",
+    "fixtures/query_resolve.hex",
+    "fixtures/query_probe.hex",
+    "fixtures/sleep_proxy.hex",
+};
+#define  CORPUS_SIZE     (int)(sizeof(corpus) / sizeof(corpus[0]))
+
+static uint8_t packets[CORPUS_SIZE][HOST_MAX_PACKET];
+static int lengths[CORPUS_SIZE];
+
+// what the walks found goes here, so they aren't optimized away
+static volatile uint32_t results;
+
+// the names the old parser matched questions against: our host name, the DNS-SD meta
+// service, and one service type per record
+static const char* ourNames[NumMDNSServiceRecords + 2] = {
+    "bench.local",
+    "_services._dns-sd._udp.local",
+    "_http._tcp.local",
+};
+
+static int matchStringPart(const uint8_t** pCmpStr, int* pCmpLen, const uint8_t* buf, int dataLen)
+{
+    int matches = (*pCmpLen >= dataLen) && 0 == memcmp(*pCmpStr, buf, dataLen);
+
+    *pCmpStr += dataLen;
+    *pCmpLen -= dataLen;
+    if ('.' == **pCmpStr)
+        (*pCmpStr)++, (*pCmpLen)--;
+
+    return matches;
+}
+
+// the old parser, cut down to its walk over the packet.
+// return value: the number of questions and records walked
+static int oldParse(const uint8_t* packet, uint16_t udp_len, int* matched)
+{
+    uint8_t buf[DNS_HEADER_SIZE];
+    uint8_t* udpBuffer = (uint8_t*)malloc(udp_len);
+    uintptr_t ptr = (uintptr_t)udpBuffer;
+    int offset = DNS_HEADER_SIZE, walked = 0;
+
+    memcpy(udpBuffer, packet, udp_len);
+    memcpy(buf, (uint8_t*)ptr, DNS_HEADER_SIZE);
+
+    uint16_t qCnt = (buf[4] << 8) | buf[5];
+    uint16_t rCnt = ((buf[6] << 8) | buf[7]) + ((buf[8] << 8) | buf[9]) + ((buf[10] << 8) | buf[11]);
+
+    for (uint16_t i = 0; i < qCnt + rCnt; i++, walked++)
+    {
+        const uint8_t* servNames[NumMDNSServiceRecords + 2];
+        int servLens[NumMDNSServiceRecords + 2];
+        uint8_t servMatches[NumMDNSServiceRecords + 2];
+
+        for (int j = 0; j < NumMDNSServiceRecords + 2; j++) {
+            servNames[j] = (const uint8_t*)ourNames[j];
+            servLens[j] = ourNames[j] ? strlen(ourNames[j]) : 0;
+            servMatches[j] = (NULL != ourNames[j]);
+        }
+
+        int rLen;
+        do {
+            memcpy(buf, (uint8_t*)(ptr + offset), 1);
+            offset += 1;
+            rLen = buf[0];
+
+            if (rLen > 128) {
+                memcpy(buf, (uint8_t*)(ptr + offset), 1);
+                offset += 1;
+            } else if (rLen > 0) {
+                for (int tr = rLen, ir; tr > 0; tr -= ir) {
+                    ir = (tr > DNS_HEADER_SIZE) ? DNS_HEADER_SIZE : tr;
+                    memcpy(buf, (uint8_t*)(ptr + offset), ir);
+                    offset += ir;
+
+                    if (i < qCnt)
+                        for (int j = 0; j < NumMDNSServiceRecords + 2; j++)
+                            if (servMatches[j])
+                                servMatches[j] &= matchStringPart(&servNames[j], &servLens[j], buf, ir);
+                }
+            }
+        } while (rLen > 0 && rLen <= 128);
+
+        if (i < qCnt) {
+            memcpy(buf, (uint8_t*)(ptr + offset), 4);
+            offset += 4;
+
+            for (int j = 0; j < NumMDNSServiceRecords + 2; j++)
+                *matched += servMatches[j] && 0 == servLens[j];
+        } else {
+            memcpy(buf, (uint8_t*)(ptr + offset), 4);
+            offset += 4;
+            memcpy(buf, (uint8_t*)(ptr + offset), 6);
+            offset += 6 + ((buf[4] << 8) | buf[5]);
+        }
+    }
+
+    free(udpBuffer);
+    return walked;
+}
+
+// the reader over the receive buffer; question names are matched by the hash of the
+// whole name, as the library looks them up in its index.
+// return value: the number of questions and records walked, or -1 if the packet is broken
+static int newParse(const uint8_t* packet, uint16_t udp_len, uint32_t* hashes)
+{
+    static uint8_t readBuffer[MDNS_READ_BUFFER_SIZE];
+    MDNSReader_t reader;
+    MDNSRecordView_t rec;
+    int walked = 0;
+
+    memcpy(readBuffer, packet, udp_len);
+    reader_init(&reader, readBuffer, udp_len);
+
+    reader_skip(&reader, 4);
+    uint16_t qCnt = reader_read_u16(&reader);
+    uint16_t rCnt = reader_read_u16(&reader) + reader_read_u16(&reader) + reader_read_u16(&reader);
+
+    for (uint16_t i = 0; i < qCnt && !reader.error; i++, walked++) {
+        *hashes += reader_read_name_hash(&reader);
+        reader_skip(&reader, 4);
+    }
+
+    for (uint16_t i = 0; i < rCnt && reader_read_record(&reader, &rec); i++, walked++)
+        *hashes += rec.nameHash;
+
+    return reader.error ? -1 : walked;
+}
+
+int main()
+{
+    int matched = 0, oldWalked = 0, newWalked = 0, expected = 0;
+    uint32_t hashes = 0;
+
+    host_reset();
+
+    for (int i = 0; i < CORPUS_SIZE; i++) {
+        CHECK(0 < (lengths[i] = host_load_fixture(corpus[i], packets[i], sizeof(packets[i]))));
+        CHECK(lengths[i] <= MDNS_READ_BUFFER_SIZE);
+
+        const uint8_t* h = packets[i];
+        expected += ((h[4] << 8) | h[5]) + ((h[6] << 8) | h[7]) + ((h[8] << 8) | h[9]) + ((h[10] << 8) | h[11]);
+    }
+
+    // both walk every question and record of the corpus
+    for (int i = 0; i < CORPUS_SIZE; i++) {
+        oldWalked += oldParse(packets[i], lengths[i], &matched);
+        newWalked += newParse(packets[i], lengths[i], &hashes);
+    }
+    CHECK(expected == oldWalked);
+    CHECK(expected == newWalked);
+
+    // both are timed in turns, and the fastest batch of each counts: the others may
+    // have been interrupted
+    double oldRate = 0, newRate = 0;
+    for (int b = 0; b < PARSER_BATCHES; b++) {
+        clock_t start = clock();
+        for (int r = 0; r < PARSER_ROUNDS; r++)
+            for (int i = 0; i < CORPUS_SIZE; i++)
+                (void)oldParse(packets[i], lengths[i], &matched);
+        double rate = PARSER_ROUNDS * CORPUS_SIZE / ((double)(clock() - start) / CLOCKS_PER_SEC);
+        if (rate > oldRate)
+            oldRate = rate;
+
+        start = clock();
+        for (int r = 0; r < PARSER_ROUNDS; r++)
+            for (int i = 0; i < CORPUS_SIZE; i++)
+                (void)newParse(packets[i], lengths[i], &hashes);
+        rate = PARSER_ROUNDS * CORPUS_SIZE / ((double)(clock() - start) / CLOCKS_PER_SEC);
+        if (rate > newRate)
+            newRate = rate;
+    }
+
+    results = matched + hashes;
+
+    printf("parser: %.0f packets per second, %.0f with the malloc + memcpy parser\n", newRate, oldRate);
+
+    return host_failures ? 1 : 0;
+}
@@ -0,0 +1,129 @@
+// Registers as many services as there is room for (NumMDNSServiceRecords), probes, and
+// checks that every one of them is announced. Then times how long a query for one of
+// them takes to answer, next to a responder with only a few services; the time mustn't
+// grow with the number of services.
+
+#include <time.h>
+
+#include "host.h"
+
+#define  QUERY_ROUNDS    (1000)
+#define  QUERY_BATCHES   (20)
+
+#define  FEW_SERVICES    ((NumMDNSServiceRecords < 8) ? NumMDNSServiceRecords : 8)
+
+static BonjourClass fewBonjour;
+
+// starts a responder with the given number of services, and checks that it probed for
+// its name and announced all of them.
+// return value: the number of services announced
+static int startResponder(BonjourClass* bonjour, const char* hostName, int services)
+{
+    char name[32], fullName[64];
+    int announced = 0, probes = 0;
+
+    host_clear_sent();
+    CHECK(bonjour->begin(hostName));
+    for (int i = 0; i < services; i++) {
+        snprintf(name, sizeof(name), "svc%d._http", i);
+        CHECK(bonjour->addServiceRecord(name, 1000 + i, MDNSServiceTCP));
+    }
+
+    host_run(bonjour, 5000);
+
+    for (int i = 0; i < services; i++) {
+        snprintf(fullName, sizeof(fullName), "svc%d._http._tcp.local", i);
+        for (int k = 0; k < host_sent_count(); k++)
+            if (packet_has_record(host_sent(k), 0x21, fullName)) {
+                announced++;
+                break;
+            }
+    }
+
+    snprintf(fullName, sizeof(fullName), "%s.local", hostName);
+    for (int k = 0; k < host_sent_count(); k++)
+        probes += packet_has_question(host_sent(k), 0xff, fullName);
+
+    CHECK(3 == probes);
+    CHECK(services == announced);
+    return announced;
+}
+
+// the query for the last service's SRV record. it comes from a legacy resolver, so it's
+// answered every time, with the clock standing still and nothing else done in between
+static void buildQuery(HostPacketBuilder_t* query, int services)
+{
+    char fullName[64];
+
+    snprintf(fullName, sizeof(fullName), "svc%d._http._tcp.local", services - 1);
+    build_begin(query, 0);
+    build_question(query, fullName, 0x21, 0x0001);
+    build_end(query);
+}
+
+static void checkAnswer(BonjourClass* bonjour, const HostPacketBuilder_t* query, int services)
+{
+    char fullName[64];
+
+    snprintf(fullName, sizeof(fullName), "svc%d._http._tcp.local", services - 1);
+
+    // whatever was due while the other responder ran goes first
+    (void)bonjour->run();
+    host_clear_sent();
+
+    host_receive(query->data, query->len, IPAddress(192, 168, 1, 20), 53000);
+    (void)bonjour->run();
+    CHECK(1 == host_sent_count() && packet_has_record(host_sent(0), 0x21, fullName));
+}
+
+static double timeBatch(BonjourClass* bonjour, const HostPacketBuilder_t* query)
+{
+    clock_t start = clock();
+
+    for (int i = 0; i < QUERY_ROUNDS; i++) {
+        host_clear_sent();
+        host_receive(query->data, query->len, IPAddress(192, 168, 1, 20), 53000);
+        (void)bonjour->run();
+    }
+
+    return 1e9 * (clock() - start) / CLOCKS_PER_SEC / QUERY_ROUNDS;
+}
+
+int main()
+{
+    HostPacketBuilder_t fewQuery, query;
+
+    host_reset();
+
+    (void)startResponder(&fewBonjour, "few", FEW_SERVICES);
+    int announced = startResponder(&Bonjour, "scale", NumMDNSServiceRecords);
+
+    buildQuery(&fewQuery, FEW_SERVICES);
+    buildQuery(&query, NumMDNSServiceRecords);
+    checkAnswer(&fewBonjour, &fewQuery, FEW_SERVICES);
+    checkAnswer(&Bonjour, &query, NumMDNSServiceRecords);
+
+    // both are timed in turns, and the fastest batch of each counts: the others may
+    // have been interrupted
+    double few = 0, all = 0;
+    for (int b = 0; b < QUERY_BATCHES; b++) {
+        double ns = timeBatch(&fewBonjour, &fewQuery);
+        if (0 == b || ns < few)
+            few = ns;
+
+        ns = timeBatch(&Bonjour, &query);
+        if (0 == b || ns < all)
+            all = ns;
+    }
+
+    // with room for timing noise, but well short of growing with the services
+    CHECK(all < 1.5 * few);
+
+    printf("%d services%s: %d announced, %.0f ns per query (%.0f with %d services), %u bytes of state\n",
+           NumMDNSServiceRecords, HAS_NAME_BROWSING ? "" : " (responder only)", announced, all, few, FEW_SERVICES,
+           (unsigned)sizeof(BonjourClass));
+
+    Bonjour.end();
+    fewBonjour.end();
+    return host_failures ? 1 : 0;
+}
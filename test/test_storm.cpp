@@ -0,0 +1,195 @@
+// A storm of 1,000 queries a second from a hundred hosts, all asking for the same record.
+// It may be multicast at most once a second (RFC 6762 6); the questions in between are
+// absorbed. Probes for our names are still defended right away.
+
+#include "host.h"
+
+#define  STORM_SECONDS   (10)
+#define  STORM_HOSTS     (100)
+
+static const IPAddress mdnsGroup(224, 0, 0, 251);
+
+static int isMulticast(const HostPacket_t* p)
+{
+    for (int i = 0; i < 4; i++)
+        if (p->ip[i] != mdnsGroup[i])
+            return 0;
+    return 5353 == p->port;
+}
+
+// the times at which packets holding a record were multicast, in ms since the first call
+static int multicastTimes(unsigned long now, uint16_t type, const char* name, unsigned long* times, int count)
+{
+    for (int k = 0; k < host_sent_count(); k++)
+        if (isMulticast(host_sent(k)) && packet_has_record(host_sent(k), type, name))
+            times[count++] = now;
+    host_clear_sent();
+    return count;
+}
+
+static void testQueryStorm()
+{
+    static unsigned long times[STORM_SECONDS * 1000];
+    HostPacketBuilder_t query;
+    int count = 0;
+
+    build_begin(&query, 0);
+    build_question(&query, "_http._tcp.local", 0x0c, 0x0001);
+    build_end(&query);
+
+    for (unsigned long t = 0; t < STORM_SECONDS * 1000; t++) {
+        host_receive(query.data, query.len, IPAddress(192, 168, 1, 10 + t % STORM_HOSTS), 5353);
+        host_run(&Bonjour, 1);
+        count = multicastTimes(t, 0x0c, "_http._tcp.local", times, count);
+    }
+
+    // answered once a second, not more and not (much) less
+    CHECK(count >= STORM_SECONDS - 1 && count <= STORM_SECONDS);
+    for (int i = 1; i < count; i++)
+        CHECK(times[i] - times[i - 1] >= 1000);
+}
+
+// a probe right after the record was multicast is answered anyway, well inside the second
+static void testProbeDefense()
+{
+    HostPacketBuilder_t query, probe;
+    unsigned long answered = 0, defended = 0;
+    int count = 0;
+
+    build_begin(&query, 0);
+    build_question(&query, "Storm._http._tcp.local", 0x21, 0x0001);
+    build_end(&query);
+
+    build_begin(&probe, 0);
+    build_question(&probe, "Storm._http._tcp.local", 0xff, 0x0001);
+    build_srv(&probe, 2, "Storm._http._tcp.local", 120, 9999, "other.local");
+    build_end(&probe);
+
+    // let the storm's window run out first
+    host_run(&Bonjour, 1000);
+    host_clear_sent();
+
+    host_receive(query.data, query.len, IPAddress(192, 168, 1, 10), 5353);
+    for (unsigned long t = 0; t < 1000 && 0 == count; t++) {
+        host_run(&Bonjour, 1);
+        count = multicastTimes(t, 0x21, "Storm._http._tcp.local", &answered, 0);
+    }
+    CHECK(1 == count);
+
+    // another query inside the second is absorbed, the probe isn't
+    host_receive(query.data, query.len, IPAddress(192, 168, 1, 11), 5353);
+    host_run(&Bonjour, 300);
+    CHECK(0 == multicastTimes(0, 0x21, "Storm._http._tcp.local", &defended, 0));
+
+    host_receive(probe.data, probe.len, IPAddress(192, 168, 1, 12), 5353);
+    count = 0;
+    for (unsigned long t = answered + 300; t < answered + 1000 && 0 == count; t++) {
+        host_run(&Bonjour, 1);
+        count = multicastTimes(t, 0x21, "Storm._http._tcp.local", &defended, 0);
+    }
+    CHECK(1 == count);
+}
+
+// answers sent from a copy hold nothing the rate limit took out: the DNS-SD PTR and our
+// address, multicast a moment ago, don't go along with the answer to a browse
+static void testCopiesRateLimited()
+{
+    HostPacketBuilder_t services, address, browse;
+    int servicesSent = 0, addressSent = 0, browseAnswered = 0;
+
+    build_begin(&services, 0);
+    build_question(&services, "_services._dns-sd._udp.local", 0x0c, 0x0001);
+    build_end(&services);
+
+    build_begin(&address, 0);
+    build_question(&address, "storm.local", 0x01, 0x0001);
+    build_end(&address);
+
+    build_begin(&browse, 0);
+    build_question(&browse, "_http._tcp.local", 0x0c, 0x0001);
+    build_end(&browse);
+
+    // let the earlier tests' windows run out first
+    host_run(&Bonjour, 2000);
+    host_clear_sent();
+
+    host_receive(services.data, services.len, IPAddress(192, 168, 1, 13), 5353);
+    host_receive(address.data, address.len, IPAddress(192, 168, 1, 13), 5353);
+    host_run(&Bonjour, 200);
+    for (int k = 0; k < host_sent_count(); k++) {
+        servicesSent |= packet_has_record(host_sent(k), 0x0c, "_services._dns-sd._udp.local");
+        addressSent |= packet_has_record(host_sent(k), 0x01, "storm.local");
+    }
+    CHECK(servicesSent && addressSent);
+
+    host_run(&Bonjour, 300);
+    host_clear_sent();
+    servicesSent = addressSent = 0;
+
+    host_receive(browse.data, browse.len, IPAddress(192, 168, 1, 14), 5353);
+    host_run(&Bonjour, 200);
+    for (int k = 0; k < host_sent_count(); k++) {
+        browseAnswered |= packet_has_record(host_sent(k), 0x0c, "_http._tcp.local");
+        servicesSent |= packet_has_record(host_sent(k), 0x0c, "_services._dns-sd._udp.local");
+        addressSent |= packet_has_record(host_sent(k), 0x01, "storm.local");
+    }
+    CHECK(browseAnswered);
+    CHECK(!servicesSent && !addressSent);
+}
+
+// a browse for a type with two instances is answered from a copy the second time; once
+// one of them is gone, the copy is too
+static void testCopyGoesWithRecord()
+{
+    HostPacketBuilder_t browse;
+    int answered = 0, stale = 0;
+
+    build_begin(&browse, 0);
+    build_question(&browse, "_http._tcp.local", 0x0c, 0x0001);
+    build_end(&browse);
+
+    CHECK(Bonjour.addServiceRecord("Other._http", 8081, MDNSServiceTCP));
+    host_run(&Bonjour, 10000);
+
+    for (int round = 0; round < 2; round++) {
+        host_clear_sent();
+        host_receive(browse.data, browse.len, IPAddress(192, 168, 1, 15), 5353);
+        host_run(&Bonjour, 1500);
+        for (int k = 0; k < host_sent_count(); k++)
+            answered += packet_has_record(host_sent(k), 0x21, "Other._http._tcp.local");
+    }
+    CHECK(2 == answered);
+
+    Bonjour.removeServiceRecord("Other._http", 8081, MDNSServiceTCP);
+    host_run(&Bonjour, 1500);
+
+    host_clear_sent();
+    host_receive(browse.data, browse.len, IPAddress(192, 168, 1, 15), 5353);
+    host_run(&Bonjour, 1500);
+    for (int k = 0; k < host_sent_count(); k++) {
+        answered += packet_has_record(host_sent(k), 0x21, "Storm._http._tcp.local");
+        stale += packet_has_record(host_sent(k), 0x21, "Other._http._tcp.local");
+    }
+    CHECK(3 == answered && 0 == stale);
+}
+
+int main()
+{
+    host_reset();
+    CHECK(Bonjour.begin("storm"));
+    CHECK(Bonjour.addServiceRecord("Storm._http", 8080, MDNSServiceTCP));
+
+    // probing and announcing are done with
+    host_run(&Bonjour, 10000);
+    host_clear_sent();
+
+    testQueryStorm();
+    testProbeDefense();
+    testCopiesRateLimited();
+    testCopyGoesWithRecord();
+
+    Bonjour.end();
+
+    printf("storm: %s\n", host_failures ? "failed" : "ok");
+    return host_failures ? 1 : 0;
+}